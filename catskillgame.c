@@ -1,6 +1,8 @@
 #include "catskillgame.h"
 #include "catskillmusic.h"
 #include "catskillgfx.h"
+#include "catskillstats.h"
+#include "catskilltrace.h"
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -76,6 +78,21 @@ enum movement
 
 enum movement budState = rest;
 
+enum hudGroups
+{ // Retained HUD overlay groups, lower groups draw on top
+    hudMessage,
+    hudStats
+};
+
+int sceneFadeFrames = 8;       // Logic frames (about 40 a second) a scene takes to fade out, and the next one to fade in. 0 = cut straight to it
+bool sceneFadePending = false; // The next scene fades in once the last one has faded out
+bool sceneCrossfade = false;   // The next scene's palette blends over from the last one's instead of going through black
+
+int hudMessageShown = -1; // What the HUD groups currently hold, so they're only rebuilt when it changes
+int hudLivesShown = -1;
+int hudPowerShown = -1;
+int hudPowerMaxShown = -1;
+
 int entryWindow;
 int budSpawnTimer = 0;
 bool budSpawned = false;
@@ -192,6 +209,17 @@ enum stateMachineGame
     theEnd
 }; // State machine of the game (under stateMachine = game)
 enum stateMachineGame gameState = bootingMenu;
+static const char *gameStateNames[] = {"bootingMenu", "splashScreen", "titleScreen", "diffSelect", "levelEdit", "saveGame", "loadGame", "game",
+                                       "story", "goHallway", "goCondo", "goJail", "goElevator", "gameOver", "pauseMode", "theEnd"};
+
+const char *gameStateName(int state)
+{ // For stats and traces
+    if (state < 0 || state > theEnd)
+    {
+        return "?";
+    }
+    return gameStateNames[state];
+}
 enum stateMachineEdit
 {
     tileDrop,
@@ -414,6 +442,58 @@ void gameSetup()
     setup();
 }
 
+// Ticks that can go by with nothing on screen changing unless a button is pressed, so the scheduler can sleep through them
+// instead of waking up for each one. The slept ticks still run when it wakes, on the buttons from before the sleep, so timers
+// and debounce counts come out as if it had stayed awake, and a key that woke it is seen on the newest tick. 0 = something is moving
+int idleTicks()
+{
+    int frames = 0;
+
+    if (musicActive() || paletteFading())
+    { // Music is fed a little every tick, a fade moves every frame
+        return 0;
+    }
+
+    switch (gameState)
+    {
+    case pauseMode:
+    case goCondo:
+    case goHallway:
+        if (displayPauseState == true && isDrawn == true)
+        { // Paused, waiting for START
+            return IDLE_UNTIL_INPUT;
+        }
+        break;
+
+    case goJail:
+        if (jailYpos >= 32)
+        { // Door shut, counting down. Bud grabs the bars at 50
+            frames = menuTimer > 51 ? menuTimer - 51 : menuTimer - 1;
+        }
+        break;
+
+    case titleScreen:
+        if (isDrawn == true)
+        { // Only the arrow animates between blinks
+            frames = 3 - cursorTimer;
+            if (menuTimer > 20 && menuTimer - 21 < frames)
+            {
+                frames = menuTimer - 21;
+            }
+            else if (menuTimer <= 20 && menuTimer - 1 < frames)
+            {
+                frames = menuTimer - 1;
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return frames > 0 ? frames * 3 : 0; // gameFrame runs every 3rd tick
+}
+
 // Master loops
 void setup()
 { //------------------------Core0 handles the file system and game logic
@@ -462,10 +542,16 @@ void setup1()
 
 void loop()
 {                    //-----------------------Core 0 handles the main logic loop
+    statsBegin(statGameLogic);
     gameLoopLogic(); // Check this every loop frame
+    statsEnd(statGameLogic);
     serviceDebounce();
+    statsBegin(statServiceAudio);
     serviceAudio();
+    statsEnd(statServiceAudio);
+    statsBegin(statServiceMusic);
     serviceMusic();
+    statsEnd(statServiceMusic);
     if (displayPauseState == true)
     { // If paused for USB xfer, push START to unpause
         if (button(start_but))
@@ -536,16 +622,36 @@ void gameLoopLogic()
 
     case 3: // Frame started?
             // gpio_put(15, 1);
+        statsBeginFrame(gameState); // Counted against the state the frame started in
         gameFrame();
+        statsEndFrame();
         gameLoopState = 0; // Done, wait for next frame flag
                            // gpio_put(15, 0);
         break;
     }
 }
 
+static gboolean quitMainLoop(gpointer data)
+{ // Logic runs on its own thread, so quitting is handed to the GTK thread
+
+    gtk_main_quit();
+    return FALSE;
+}
+
 void gameFrame()
 {
 
+    if (paletteFadingOut())
+    { // Last scene is still fading out (its picture is held), the new one is set up once the screen is black
+        LCDsetDrawFlag();
+        return;
+    }
+    if (sceneFadePending)
+    {
+        sceneFadePending = false;
+        paletteFadeIn(sceneFadeFrames);
+    }
+
     switch (gameState)
     {
 
@@ -705,13 +811,13 @@ void gameFrame()
 
             case 13:
                 // switchGameTo(pauseMode);
-                gtk_main_quit();
+                g_idle_add(quitMainLoop, NULL);
                 break;
             }
         }
         if (button(start_but))
         {
-            gtk_main_quit();
+            g_idle_add(quitMainLoop, NULL);
         }
         // if (button(B_but) && cursorY == 11) {		//DEV MODE - DISABLE
         // menuTimer = 0;
@@ -871,22 +977,43 @@ void gameFrame()
             switchGameTo(titleScreen);   
         }
     }
-    drawPlayfield();
+    LCDsetDrawFlag(); // Frame logic done, the presenter renders it straight into the display surface
 }
 
 void switchGameTo(enum stateMachineGame x)
 { // Switches state of game
 
+    // A cutscene moving on to its next picture cuts straight over, and the new picture's palette crossfades in from the old
+    // one's when setupStory loads it (see loadScenePalette)
+    sceneCrossfade = sceneFadeFrames > 0 && gameState == story && x == story;
+
     displayPause(true);
     gameState = x;
     isDrawn = false;
+    clearRaster(); // Scenes set up their own line effects
+    if (sceneFadeFrames > 0 && sceneCrossfade == false)
+    { // Old scene fades to black, then the new one comes up from black. Palettes are resident after the first visit, so this never waits on disk
+        paletteFadeOut(sceneFadeFrames);
+        sceneFadePending = true;
+    }
+}
+
+// Loads a scene's palette. When switchGameTo asked for a crossfade it blends over from the colors on screen instead of cutting
+void loadScenePalette(const char *path)
+{
+    if (sceneCrossfade)
+    {
+        sceneCrossfade = false;
+        paletteCrossfade(path, sceneFadeFrames);
+        return;
+    }
+    loadPalette(path);
 }
 
 void displayPause(bool state)
 {
 
     displayPauseState = state;
-    pauseLCD(state);
 }
 
 void drawSplashScreen()
@@ -1860,6 +1987,7 @@ void jailLogic()
 
 void setupCondo(int whichFloor, int whichCondo)
 {
+    traceBegin("setupCondo", NULL);
 
     mapWidth = condoWidth;
 
@@ -1972,6 +2100,7 @@ void setupCondo(int whichFloor, int whichCondo)
     budStunned = 0;
 
     movingObjects(true); // Tell robots to move
+    traceEnd();
 }
 
 void redrawMapTiles()
@@ -2086,31 +2215,40 @@ void condoLogic()
 
             if (kittenMessageTimer & 0x04)
             {
-                int offset = 4;
+                int message = kittenToRescue - kittenCount; // Kittens left is all that changes the message, 0 = GOTO THE EXIT
 
-                if ((kittenToRescue - kittenCount) > 9)
+                if (hudMessageShown != message)
                 {
-                    offset = 0;
-                }
+                    int offset = 4;
 
-                if (kittenCount == kittenToRescue)
-                {
-                    drawSpriteText("GOTO THE EXIT", 8, 56, 3);
-                }
-                else
-                {
-                    drawSpriteText("RESCUE", 28 + offset, 52, 3);
-                    drawSpriteDecimal(kittenToRescue - kittenCount, 84 + offset, 52, 3); // Delta of kittens to save
+                    if ((kittenToRescue - kittenCount) > 9)
+                    {
+                        offset = 0;
+                    }
 
-                    if (kittenCount == (kittenToRescue - 1))
-                    { // Only one KITTENS left? Draw a sloppy slash over the S
-                        drawSpriteText("KITTEN", 36, 60, 3);
+                    hudBegin(hudMessage);
+                    if (kittenCount == kittenToRescue)
+                    {
+                        drawSpriteText("GOTO THE EXIT", 8, 56, 3);
                     }
                     else
                     {
-                        drawSpriteText("KITTENS", 36, 60, 3);
+                        drawSpriteText("RESCUE", 28 + offset, 52, 3);
+                        drawSpriteDecimal(kittenToRescue - kittenCount, 84 + offset, 52, 3); // Delta of kittens to save
+
+                        if (kittenCount == (kittenToRescue - 1))
+                        { // Only one KITTENS left? Draw a sloppy slash over the S
+                            drawSpriteText("KITTEN", 36, 60, 3);
+                        }
+                        else
+                        {
+                            drawSpriteText("KITTENS", 36, 60, 3);
+                        }
                     }
+                    hudEnd();
+                    hudMessageShown = message;
                 }
+                hudShow(hudMessage);
             }
             kittenMessageTimer--;
         }
@@ -2130,7 +2268,9 @@ void condoLogic()
 
     // drawSpriteDecimalRight(score, 107, 4, 0);		//Right justified score
     drawBudStats();
+    statsBegin(statBudLogic);
     budLogic2();
+    statsEnd(statBudLogic);
 
     if (budState == dead)
     {
@@ -2162,7 +2302,9 @@ void condoLogic()
 
     setWindow((xWindowCoarse << 3) | (xWindowFine + xShake), yPos + yShake); // Set scroll window
 
+    statsBegin(statObjectLogic);
     objectLogic();
+    statsEnd(statObjectLogic);
 
     if (currentTrack != currentFloor) {
         playTrack(currentFloor, true);
@@ -2173,6 +2315,7 @@ void condoLogic()
 
 void setupHallway()
 {
+    traceBegin("setupHallway", NULL);
 
     mapWidth = hallwayWidth;
 
@@ -2282,6 +2425,7 @@ void setupHallway()
     isDrawn = true;
 
     waitPriorityChange = false; // Hacky fix
+    traceEnd();
 }
 
 void spawnIntoHallway(int windowStartCoarseX, int budStartCoarseX, int budStartFineY)
@@ -2346,7 +2490,14 @@ void hallwayLogic()
         {
             if (kittenMessageTimer & 0x04)
             {
-                drawSpriteText("GOTO ELEVATOR", 8, 56, 3);
+                if (hudMessageShown != -2)
+                { // -2 = the hallway message, condo messages are 0 and up
+                    hudBegin(hudMessage);
+                    drawSpriteText("GOTO ELEVATOR", 8, 56, 3);
+                    hudEnd();
+                    hudMessageShown = -2;
+                }
+                hudShow(hudMessage);
             }
             kittenMessageTimer--;
         }
@@ -2357,12 +2508,16 @@ void hallwayLogic()
 
     if (budState == entering)
     { // If Bud is entering elevator or condo, draw robots first so they appear in front of him
+        statsBegin(statObjectLogic);
         objectLogic();
+        statsEnd(statObjectLogic);
     }
 
     if (budSpawned == true)
     {
+        statsBegin(statBudLogic);
         budLogic2();
+        statsEnd(statBudLogic);
     }
     else
     {
@@ -2432,14 +2587,18 @@ void hallwayLogic()
 
     if (budState != entering)
     { // Default draw Bud first so he appears over things like chandeliers
+        statsBegin(statObjectLogic);
         objectLogic();
+        statsEnd(statObjectLogic);
     }
     else
     {
         if (waitPriorityChange == true)
         {                               // Bud's state just changed, and we need one more frame before flipping priority?
             waitPriorityChange = false; // Clear flag and...
-            objectLogic();              // DEW IT
+            statsBegin(statObjectLogic);
+            objectLogic(); // DEW IT
+            statsEnd(statObjectLogic);
         }
     }
 
@@ -2979,6 +3138,7 @@ void elevatorLogic()
 
 void setupStory()
 {
+    traceBegin("setupStory", NULL);
 
     mapWidth = hallwayWidth; // We used hallway mode to draw most of the story screens
 
@@ -2995,7 +3155,7 @@ void setupStory()
     {
 
     case 0:
-        loadPalette("story/reporter2.dat");          // Load palette colors from a YY-CHR file. Can be individually changed later on
+        loadScenePalette("story/reporter2.dat");     // Load palette colors from a YY-CHR file. Can be individually changed later on
         loadPattern("story/reporter_t.nes", 0, 512); // Table 0 = condo tiles + a few sprites for eye, hair and EXPLOSIONS!
 
         drawStoryScreen(0);
@@ -3005,7 +3165,7 @@ void setupStory()
         break;
 
     case 1:
-        loadPalette("story/rob_12.dat");             // Load palette colors from a YY-CHR file. Can be individually changed later on
+        loadScenePalette("story/rob_12.dat");        // Load palette colors from a YY-CHR file. Can be individually changed later on
         loadPattern("story/rob_nice_t.nes", 0, 256); // Table 0 = condo tiles + a few sprites for eye, hair and EXPLOSIONS!
 
         drawStoryScreen(1);
@@ -3015,7 +3175,7 @@ void setupStory()
         break;
 
     case 2:
-        loadPalette("story/reporter2.dat");          // Load palette colors from a YY-CHR file. Can be individually changed later on
+        loadScenePalette("story/reporter2.dat");     // Load palette colors from a YY-CHR file. Can be individually changed later on
         loadPattern("story/reporter_t.nes", 0, 512); // Table 0 = condo tiles + a few sprites for eye, hair and EXPLOSIONS!
 
         drawStoryScreen(0);
@@ -3028,7 +3188,7 @@ void setupStory()
         break;
 
     case 3:
-        loadPalette("story/rob_12.dat");             // Load palette colors from a YY-CHR file. Can be individually changed later on
+        loadScenePalette("story/rob_12.dat");        // Load palette colors from a YY-CHR file. Can be individually changed later on
         loadPattern("story/rob_evil_t.nes", 0, 256); // Table 0 = condo tiles + a few sprites for eye, hair and EXPLOSIONS!
 
         drawStoryScreen(2);
@@ -3038,7 +3198,7 @@ void setupStory()
         break;
 
     case 4:
-        loadPalette("story/kitten.dat");           // Load palette colors from a YY-CHR file. Can be individually changed later on
+        loadScenePalette("story/kitten.dat");      // Load palette colors from a YY-CHR file. Can be individually changed later on
         loadPattern("story/kitten_t.nes", 0, 256); // Table 0 = condo tiles + a few sprites for eye, hair and EXPLOSIONS!
 
         drawStoryScreen(3);
@@ -3050,7 +3210,7 @@ void setupStory()
         break;
 
     case 5:
-        loadPalette("story/bud_face.dat");           // Load palette colors from a YY-CHR file. Can be individually changed later on
+        loadScenePalette("story/bud_face.dat");      // Load palette colors from a YY-CHR file. Can be individually changed later on
         loadPattern("story/bud_face_t.nes", 0, 256); // Table 0 = condo tiles
 
         fillTiles(0, 0, 31, 31, ' ', 3);
@@ -3079,6 +3239,7 @@ void setupStory()
     setWindow(0, 0);
     isDrawn = true;
     displayPause(false);
+    traceEnd();
 }
 
 void storyLogic()
@@ -3270,10 +3431,7 @@ void storyLogic()
             worldX -= 4;
         }
 
-        for (int row = 0; row < 10; row++)
-        {
-            setWindowSlice(row, worldX);
-        }
+        setRasterScrollXRange(0, 79, worldX); // Picture slides in, the text rows below stay put
 
         menuTimer--;
 
@@ -3407,13 +3565,8 @@ void endingLogic()
         }
     }
 
-    for (int g = 0; g < 9; g++)
-    { // Scroll slices, leave bottom text static
-
-        setWindowSlice(g, worldX);
-    }
-
-    setWindowSlice(9, worldY);
+    setRasterScrollXRange(0, 71, worldX); // Buildings scroll slowly and the grass strip fast, the text below them stays put
+    setRasterScrollXRange(72, 79, worldY);
 
     if (--worldY < 0)
     {
@@ -3564,23 +3717,33 @@ void nextFloor()
 }
 
 void drawBudStats()
-{
-
-    drawSpriteTile(4, 4, 0x01F8, 4, false, false);  // face
-    drawSpriteTile(12, 4, 0x01F9, 0, false, false); // X
-    drawSpriteDecimal(budLives, 20, 4, 0);          // lives
+{ // Lives and power live in a retained HUD group, only redrawn when they change
 
-    for (int x = 0; x < powerMax; x++)
+    if (budLives != hudLivesShown || budPower != hudPowerShown || powerMax != hudPowerMaxShown)
     {
-        if (budPower > x)
-        {
-            drawSpriteTile((x << 3) + 4, 14, 0x01FB, 4, false, false);
-        }
-        else
+        hudBegin(hudStats);
+        drawSpriteTile(4, 4, 0x01F8, 4, false, false);  // face
+        drawSpriteTile(12, 4, 0x01F9, 0, false, false); // X
+        drawSpriteDecimal(budLives, 20, 4, 0);          // lives
+
+        for (int x = 0; x < powerMax; x++)
         {
-            drawSpriteTile((x << 3) + 4, 14, 0x01FA, 4, false, false);
+            if (budPower > x)
+            {
+                drawSpriteTile((x << 3) + 4, 14, 0x01FB, 4, false, false);
+            }
+            else
+            {
+                drawSpriteTile((x << 3) + 4, 14, 0x01FA, 4, false, false);
+            }
         }
+        hudEnd();
+
+        hudLivesShown = budLives;
+        hudPowerShown = budPower;
+        hudPowerMaxShown = powerMax;
     }
+    hudShow(hudStats);
 }
 
 void budDamage()
@@ -5530,6 +5693,7 @@ void saveLevel()
 
 void loadLevel()
 {
+    traceBegin("loadLevel", mapFileName);
 
     stopAudio();
 
@@ -5539,6 +5703,7 @@ void loadLevel()
         // Serial.println("FILE NOT FOUND");
         messageTimer = 30;
         redrawEditWindow();
+        traceEnd();
         return;
     }
 
@@ -5615,6 +5780,7 @@ void loadLevel()
 
     // Serial.print("Total objects loaded from file = ");
     // Serial.println(highestObjectIndex);
+    traceEnd();
 }
 
 void editLogic()
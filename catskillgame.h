@@ -12,6 +12,7 @@ void gameLoopLogic();
 void gameFrame();
 void switchGameTo(enum stateMachineGame x);
 void displayPause(bool state);
+void loadScenePalette(const char *path);
 void drawSplashScreen();
 void drawTitleScreen();
 void drawPauseMenu();
@@ -114,6 +115,9 @@ void makeMessage(const char *text);
 void clearMessage();
 void gameLoop();
 void gameSetup();
+#define IDLE_UNTIL_INPUT 0x7FFF // idleTicks() when only a button press changes anything
+int idleTicks();
+const char *gameStateName(int state);
 void go_setPos(int index, uint16_t atX, uint16_t atY);					//Sets position in world
 void go_defineTiles(int index,int x1, int y1, int x2, int y2);			//Defines most objects. Calling this calcs height and width for hitboxes
 void go_defineTileSingle(int index,int whichTile);						//Defines a single tile object like a Greenie
@@ -1,13 +1,19 @@
 // Game & graphics driver for gameBadgePico (MGC 2023)
 #define MINIAUDIO_IMPLEMENTATION
 #include "catskillgfx.h"
+#include "catskilltrace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 #include "miniaudio.h"
 
-uint8_t playfield[ROWS * COLS * BYTES_PER_PIXEL];
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RENDER_X86 // The AVX2 palette resolve kernel is compiled in with target attributes and picked at runtime by setRenderKernel()
+#include <immintrin.h>
+#endif
 
 FILE *file;
 
@@ -16,20 +22,45 @@ bool fileActive = false; // True =  a file is open (reading level, playing audio
 #define LCD_WIDTH 240
 #define LCD_HEIGHT 240
 
-static uint16_t linebuffer[2][3840]; // Sets up 2 buffers of 120 longs x 16 lines high
-                                     //--------Y---X--- We put the X value second so we can use a pointer to rake the data
 static uint16_t nameTable[32][32];   // 4 screens of tile data. Can scroll around it NES-style (LCD is 15x15, tile is 16X16, slightly larger) X is 8 bytes wider to hold the palette reference (similar to NES but with 1 cell granularity)
-static uint16_t patternTable[8192];  // 256 char patterns X 8 lines each, 16 bits per line. Same size as NES but chunky pixel, not bitplane and stored in shorts
-static uint16_t spriteBuffer[14400];
-uint16_t paletteRGB[64];         // Stores the 32 colors as RGB values, pulled from nesPaletteRGBtable (with space for 32 extra)
-uint16_t nesPaletteRGBtable[64]; // Stores the current NES palette in 16 bit RGB format
+static uint8_t patternPixels[2][8192][8]; // 256 char patterns X 8 lines each, decoded at load time to one color index (0-3) per byte so the renderer copies instead of shifting. [1] is mirrored for hFlip
+uint32_t paletteRGB[64];         // Stores the 32 colors as XRGB values, pulled from nesPaletteRGBtable (with space for 32 extra)
+uint32_t nesPaletteRGBtable[64]; // Stores the current NES palette in 32 bit XRGB format, the same format the frame is presented in
 
-#define spriteAlphaColor 0x0001 // The 16-bit LCD RGB color that is used for sprite transparency (make sure nothing in the palette matches it)
+#define PALETTE_SETS 32 // Palette files kept in memory after their first load, so scene changes never go to disk for them
+
+typedef struct
+{
+    char path[64];
+    char index[64]; // nesPaletteRGBtable index of each of the 64 colors, as stored in the file
+} PaletteSet;
+
+static PaletteSet paletteSets[PALETTE_SETS];
+static int paletteSetCount = 0;
+
+#define FADE_LEVELS 16
+
+enum fadeTypes
+{
+    fadeNone,
+    fadeOut,
+    fadeBlack, // Fade out finished, holding
+    fadeIn,
+    fadeCross
+};
+
+static uint8_t fadeTable[FADE_LEVELS + 1][256]; // Channel value scaled by level / FADE_LEVELS
+static uint32_t fadeFrom[64];                   // Colors on screen when a fade out or crossfade started
+static int fadeType = fadeNone;
+static int fadeFrame = 0;
+static int fadeFrames = 0;
 
 uint16_t baseASCII = 32;            // Stores what tile in the pattern table is the start of printable ASCII (space, !, ", etc...) User can change the starting position to put ASCII whereever they want in pattern table, but this is the default
 uint8_t textWrapEdges[2] = {0, 14}; // Sets a left and right edge where text wraps in the tilemap. Use can change this, default is left side of scroll, one screen wide
 bool textWordWrap = true;           // Is spacing word-wrap enabled (fancy!)
 
+static uint32_t nameRowDirty = 0xFFFFFFFF; // Nametable rows whose tiles or palettes changed since the last snapshot, one bit each
+
 uint8_t winX[32];
 uint8_t winXfine[32];
 uint8_t winY = 0;
@@ -42,6 +73,134 @@ int xRight = 120;
 int yTop = -1;
 int yBottom = 120;
 
+typedef struct
+{                        // Per scanline overrides, like registers written during hblank on the NES
+    uint8_t flags;       // rasterScrollX / rasterJumpY / rasterPalette
+    uint8_t winX;        // Scroll for this line instead of its nametable row's
+    uint8_t winXfine;
+    uint8_t jumpRow;     // Nametable row and pattern line this line reads, following lines carry on from there
+    uint8_t jumpFine;
+    uint8_t paletteBank; // XOR'd into the background palette number of every pixel on the line
+} RasterLine;
+
+#define rasterScrollX 0x01
+#define rasterJumpY 0x02
+#define rasterPalette 0x04
+
+static RasterLine rasterLines[FRAME_HEIGHT];
+static uint16_t rasterBands = 0; // Bands with any line set, one bit each. The rest render exactly as before
+static bool rasterDirty = false;
+
+#define SPRITE_MAX 1024 // 8x8 sprites per frame. Sprites drawn past this are dropped, like OAM overflow (the game tops out far below it)
+
+typedef struct
+{                     // One 8x8 sprite (or cached metasprite) as drawn by logic, rasterized later a scanline at a time by the renderer (like an OAM entry)
+    int16_t x;        // Top left corner on screen, can be off the edges
+    int16_t y;
+    int16_t meta;     // Metasprite cache entry to draw instead of a tile, -1 for a plain 8x8 tile
+    uint16_t pattern; // First pattern line of the tile
+    uint8_t palette;  // Palette * 4, the first of its 4 colors
+    uint8_t flags;    // spriteHFlip / spriteVFlip
+    uint8_t left;     // Visible part of the sprite, already clipped to the sprite window and screen. Right and bottom are exclusive
+    uint8_t right;
+    uint8_t top;
+    uint8_t bottom;
+} SpriteEntry;
+
+#define spriteHFlip 0x01 // Also the patternPixels copy an hFlip sprite reads from
+#define spriteVFlip 0x02
+
+static SpriteEntry spriteLists[2][SPRITE_MAX]; // Logic fills one list while the renderer draws from the other
+static SpriteEntry *spriteList = spriteLists[0];
+static int spriteCount = 0;
+
+#define HUD_GROUP_MAX 32 // Sprites per HUD group
+
+static SpriteEntry hudGroups[HUD_GROUPS][HUD_GROUP_MAX]; // Retained HUD sprites, kept until the group is redrawn
+static int hudGroupCount[HUD_GROUPS];
+static int hudTarget = -1;       // Group drawSprite calls go to between hudBegin() and hudEnd(), -1 = this frame's sprite list
+static uint8_t hudVisible = 0;   // Groups shown this frame, one bit each
+static uint8_t hudSnapshotVisible = 0;
+static bool hudChanged = true;
+
+#define METASPRITE_MAX 128         // Distinct drawSpriteRange() calls cached at once
+#define METASPRITE_PIXELS 65536    // Shared pool for their pixels
+#define METASPRITE_RUNS 16384      // and their solid runs
+#define METASPRITE_MAX_HEIGHT 64   // 8 tiles, taller ranges are drawn tile by tile
+#define METASPRITE_MAX_WIDTH 128
+
+typedef struct
+{                      // A drawSpriteRange() composed once into a pixel block, then drawn as a single sprite
+    uint16_t tileX;    // Key, the drawSpriteRange() arguments that change what it looks like
+    uint16_t tileY;
+    uint16_t xWide;
+    uint16_t yHigh;
+    uint8_t palette;
+    uint8_t flags;
+    uint8_t width;     // Size in pixels
+    uint8_t height;
+    uint32_t pixels;   // Offset of the block in metaPixels, one paletteRGB index per pixel (0 = transparent)
+    uint16_t rowRuns[METASPRITE_MAX_HEIGHT]; // Offset of each line's runs in metaRuns, a 0 length run ends the line
+} Metasprite;
+
+typedef struct
+{
+    uint8_t start; // Solid pixels on a line, transparent gaps between runs are skipped without looking at them
+    uint8_t length;
+} MetaspriteRun;
+
+static Metasprite metasprites[METASPRITE_MAX];
+static uint8_t metaPixels[METASPRITE_PIXELS];
+static MetaspriteRun metaRuns[METASPRITE_RUNS];
+static int metaCount = 0;
+static int metaPixelsUsed = 0;
+static int metaRunsUsed = 0;
+static int metaFlush = 0; // 1 = cache is stale, 2 = waiting for the renderer to drop the last frame that used it (see snapshotVideo)
+static uint32_t metaHits = 0;
+static uint32_t metaMisses = 0;
+
+// Everything the renderer reads, copied by snapshotVideo() at the end of each logic frame so logic can start the next
+// frame while this one is composited (the dual core split from the gameBadge, Core0 logic Core1 LCD)
+typedef struct
+{
+    uint16_t nameTable[32][32];
+    uint8_t patternPixels[2][8192][8]; // Sprites can use any bank, so all of it, plus the mirrored copy
+    uint32_t paletteRGB[64];
+    uint8_t winX[32];
+    uint8_t winXfine[32];
+    uint8_t winY;
+    uint8_t winYfine;
+    uint8_t winYJumpList[16];
+    uint8_t winYreset;
+    uint8_t winYrollover;
+    RasterLine raster[FRAME_HEIGHT];
+    uint16_t rasterBands;
+    uint32_t rowsChanged; // Nametable rows that look different than in the last frame rendered (tiles or horizontal scroll)
+    bool paletteChanged;
+    bool redrawAll;       // Something every band depends on changed (patterns, raster effects, Y rollover)
+                          // These three build up over snapshots that aren't rendered (interpolation) and are cleared by drawPlayfield
+    SpriteEntry *sprites; // Sprite lists are swapped instead of copied
+    int spriteCount;
+    SpriteEntry hud[HUD_GROUPS * HUD_GROUP_MAX]; // Visible HUD groups, in group order. Copied only when they change
+    int hudCount;
+    int xLeft;            // Sprite window, for clipping sprites moved by interpolation
+    int xRight;
+    int yTop;
+    int yBottom;
+    uint8_t fromX[32];    // The frame before this one, when interpolation is on. Row scroll in pixels
+    uint8_t fromRasterX[FRAME_HEIGHT]; // Line scroll from the raster table in pixels, likewise
+    SpriteEntry fromSprites[SPRITE_MAX];
+    int fromCount;
+} VideoState;
+
+static VideoState video;
+static bool interpolation = false;
+
+#define INTERPOLATE_MAX 16 // Pixels something can move in a frame and still be interpolated, anything further is a jump (a new room, a sprite slot reused)
+
+static SpriteEntry blendSprites[SPRITE_MAX]; // Sprite list of an in between frame
+static bool patternDirty = true; // Set when patterns are loaded so the snapshot only copies them when they changed
+
 uint32_t audioSamples = 0;
 uint8_t whichAudioBuffer = 0;
 bool audioPlaying = false;
@@ -160,14 +319,8 @@ bool button(uint8_t which)
 
 void initGfx()
 {
-    int i;
-    int p = 0;
-    for (i = 0; i < (ROWS * COLS); i++)
-    {
-        playfield[p++] = 0;
-        playfield[p++] = 0;
-        playfield[p++] = 0;
-    }
+    setRenderKernel(kernelAVX2); // Use the best kernel this CPU has
+    buildFadeTable();
     initAudio();
 }
 
@@ -219,59 +372,192 @@ bool loadRGB(const char *path)
     {
         fread(&r, sizeof(r), 1, file);
         fread(&g, sizeof(g), 1, file);
-        fread(&b, sizeof(b), 1, file); // Convert each 3 byte 24-bit RGB value from disk to 16-bit color in RAM that uses same color space as ST7789 LCD
+        fread(&b, sizeof(b), 1, file); // Convert each 3 byte 24-bit RGB value from disk to the 32-bit XRGB the frame is presented in
         updatePaletteRGB(x, r, g, b);  // We do as much math up front during loads to save time during frame render (trading RAM for speed)
     }
     fclose(file);
     return true;
 }
 
-// Loads  the YY-CHR palette data file (.dat) from file into RAM. There are 8 palettes of 4 colors each (sprites use color 0 as transparency, tiles can set 4 unique colors)
-void loadPalette(const char *path)
+// Returns the resident copy of a palette file, reading it from disk the first time it's asked for
+static PaletteSet *findPaletteSet(const char *path)
 {
+    for (int x = 0; x < paletteSetCount; x++)
+    {
+        if (strcmp(paletteSets[x].path, path) == 0)
+        {
+            return &paletteSets[x];
+        }
+    }
+
     FILE *file;
     file = fopen(path, "rb");
     if (!file)
     {
         printf("Unable to open palette file!\n");
-        return;
+        return NULL;
     }
-    char c;
+
+    PaletteSet *set = &paletteSets[paletteSetCount < PALETTE_SETS ? paletteSetCount++ : PALETTE_SETS - 1]; // Out of room? Reuse the last slot
+    char c = 0;
+    snprintf(set->path, sizeof(set->path), "%s", path);
     for (int x = 0; x < 64; x++)
     {
-        fread(&c, sizeof(c), 1, file);
-        updatePalette(x, c); // Use palette.dat file to create an RGB reference for all 32 colors
+        fread(&c, sizeof(c), 1, file); // A short file repeats its last byte, like it always did
+        set->index[x] = c;
     }
     fclose(file);
+
+    return set;
+}
+
+// Loads  the YY-CHR palette data file (.dat) from file into RAM. There are 8 palettes of 4 colors each (sprites use color 0 as transparency, tiles can set 4 unique colors)
+void loadPalette(const char *path)
+{
+    PaletteSet *set;
+
+    traceBegin("loadPalette", path);
+    set = findPaletteSet(path);
+    if (set == NULL)
+    {
+        traceEnd();
+        return;
+    }
+    for (int x = 0; x < 64; x++)
+    {
+        updatePalette(x, set->index[x]); // Use palette.dat file to create an RGB reference for all 32 colors
+    }
+    traceEnd();
     // This loads 32 byte indexes from disk that point to the table loaded by loadRGB, ie: if palette 0, color 0 (first byte in file) contains a 1, it
     // is referencing the second byte (index[1]) of the nesPaletteRGBtable[] table.
 }
 
-// To save math we copy the RGB values (as a 16-bit number) to the paletteRGB index.
+// Starts a timed fade of the displayed palette. Logic keeps changing the palette as usual, the fade is applied on top
+// as each frame is snapshotted, so it costs nothing but a table lookup per color
+static void startFade(int type, int frames)
+{
+    fadeType = frames > 0 ? type : fadeNone;
+    fadeFrame = 0;
+    fadeFrames = frames;
+}
+
+// Fades the display to black over frames logic frames, and holds it there until the next fade in. The picture on screen is
+// held too (see snapshotVideo), so whatever logic draws for the next scene stays hidden until it fades in
+void paletteFadeOut(int frames)
+{
+    memcpy(fadeFrom, video.paletteRGB, sizeof(fadeFrom)); // As shown, part way through a fade in or not
+    startFade(fadeOut, frames);
+    if (frames <= 0)
+    {
+        fadeType = fadeBlack;
+    }
+}
+
+// Fades the display up from black over frames logic frames
+void paletteFadeIn(int frames)
+{
+    startFade(fadeIn, frames);
+}
+
+// Switches to a resident palette file, blending over from the colors on screen now across frames logic frames. The picture
+// isn't held, only its colors move from the old set to the new one
+void paletteCrossfade(const char *path, int frames)
+{
+    memcpy(fadeFrom, video.paletteRGB, sizeof(fadeFrom)); // As shown, part way through another fade or not
+    loadPalette(path);
+    startFade(fadeCross, frames);
+}
+
+// True while the display is fading out to black
+bool paletteFadingOut()
+{
+    return fadeType == fadeOut;
+}
+
+// True while any fade is still changing the display
+bool paletteFading()
+{
+    return fadeType == fadeOut || fadeType == fadeIn || fadeType == fadeCross;
+}
+
+// Builds the per-channel scaling table fades use (once, in initGfx)
+void buildFadeTable()
+{
+    for (int level = 0; level <= FADE_LEVELS; level++)
+    {
+        for (int c = 0; c < 256; c++)
+        {
+            fadeTable[level][c] = (c * level) / FADE_LEVELS;
+        }
+    }
+}
+
+// Scales every channel of an XRGB color by fade level (0 = black, FADE_LEVELS = unchanged)
+static uint32_t fadeColor(uint32_t color, int level)
+{
+    const uint8_t *scale = fadeTable[level];
+
+    return (scale[(color >> 16) & 0xFF] << 16) | (scale[(color >> 8) & 0xFF] << 8) | scale[color & 0xFF];
+}
+
+// Advances a running fade by one frame
+static void stepFade()
+{
+    if (fadeType != fadeNone && fadeType != fadeBlack && ++fadeFrame > fadeFrames)
+    { // Done? Fade outs hold black, the others are back to the plain palette
+        fadeType = fadeType == fadeOut ? fadeBlack : fadeNone;
+    }
+}
+
+static void applyFade()
+{
+    if (fadeType == fadeNone)
+    {
+        return;
+    }
+
+    int level = fadeType == fadeBlack ? 0 : (fadeFrame * FADE_LEVELS) / fadeFrames;
+
+    for (int x = 0; x < 64; x++)
+    {
+        switch (fadeType)
+        {
+        case fadeOut:
+            video.paletteRGB[x] = fadeColor(fadeFrom[x], FADE_LEVELS - level);
+            break;
+        case fadeIn:
+            video.paletteRGB[x] = fadeColor(video.paletteRGB[x], level);
+            break;
+        case fadeCross: // Channels never carry because the two scales add up to FADE_LEVELS
+            video.paletteRGB[x] = fadeColor(fadeFrom[x], FADE_LEVELS - level) + fadeColor(video.paletteRGB[x], level);
+            break;
+        default:
+            video.paletteRGB[x] = 0;
+            break;
+        }
+    }
+
+    stepFade();
+}
+
+// To save math we copy the RGB values (as a 32-bit number) to the paletteRGB index.
 void updatePalette(int position, int theIndex)
 { // Allows game code to update palettes off flash/SD
 
     paletteRGB[position] = nesPaletteRGBtable[theIndex];
-    // Updates the palette table with the 16-bit value stored in the master list of available colors (that were loaded in with loadRGB)
+    // Updates the palette table with the 32-bit value stored in the master list of available colors (that were loaded in with loadRGB)
     // You can also use this function for dynamic palette changes, like the Mega Man 2 waterfall
 }
 
-// Converts a 24-bit RGB value (such as RGB file) to the 16-bit color of the ST7789 LCD
+// Converts a 24-bit RGB value (such as RGB file) to the 32-bit XRGB color the frame is presented in (cairo RGB24)
 void updatePaletteRGB(int position, char r, char g, char b)
 { // Allows game code to update palettes off flash/SD
 
-    uint16_t red = r;
-    uint16_t green = g;
-    uint16_t blue = b;
-
-    red &= 0xF8;   // Lob off bottom 3 bits
-    red <<= 8;     // Pack to MSB
-    green &= 0xFC; // Lob off bottom 2 bits (because evolution)
-    green <<= 3;   // Pack to middle
-    blue &= 0xF8;  // Lobb off bottom 3 bits
-    blue >>= 3;    // Pack to LSB
+    uint32_t red = (unsigned char)r; // char may be signed, don't let it smear into the other channels
+    uint32_t green = (unsigned char)g;
+    uint32_t blue = (unsigned char)b;
 
-    nesPaletteRGBtable[position] = red | green | blue; // Put the 16-bit color value in the palette RGB index (max 64 colors)
+    nesPaletteRGBtable[position] = (red << 16) | (green << 8) | blue; // Put the 32-bit color value in the palette RGB index (max 64 colors)
 }
 
 // Loads a YY-CHR .nes file (pattern table data, aka graphics) from disk and stores it in Pico RAM
@@ -281,10 +567,12 @@ void loadPattern(const char *path, uint16_t start, uint16_t length)
     unsigned char lowBit[8];
     unsigned char highBit[8];
     FILE *file;
+    traceBegin("loadPattern", path);
     file = fopen(path, "rb");
     if (!file)
     {
         printf("Unable to open pattern file!\n");
+        traceEnd();
         return;
     }
 
@@ -295,6 +583,7 @@ void loadPattern(const char *path, uint16_t start, uint16_t length)
         convertBitplanePattern(numChar << 3, lowBit, highBit); // Pass array points to function that will convert to chunky pixels
     }
     fclose(file);
+    traceEnd();
     // NES pattern tables used planer (bitplane) graphics. Each pixel was represented by 2 bits (thus 4 colors) but the bits were not next to each other in memory
     // They were stored at different offsets (planer) This was used by a lot of computers in the 80's such as the Atari ST and Amiga. A 4 bit (16 color) image was
     // stored in memory as (4) separate 1 bit patterns and combined by video hardware https://en.wikipedia.org/wiki/Planar_(computer_graphics)
@@ -304,13 +593,23 @@ void loadPattern(const char *path, uint16_t start, uint16_t length)
     // Unlike the NES you can either any tile for either spites or tiles
 }
 
+// Every nametable write goes through here so the renderer knows which rows it can reuse from the last frame
+static void setNameTable(int tileX, int tileY, uint16_t theData)
+{
+    if ((nameTable[tileY][tileX] ^ theData) & 0x07FF)
+    { // Tile or palette changed. The flag bits are never drawn, so setTileType doesn't count
+        nameRowDirty |= 1u << tileY;
+    }
+    nameTable[tileY][tileX] = theData;
+}
+
 // In tilemap position X/Y, draw the tile at index "whattile" from the pattern table using whatPalette (0-7)
 void drawTile(int xPos, int yPos, uint16_t whatTile, char whatPalette, int flags)
 {
 
     flags &= 0xF8; // You can use the top 5 bits for attributes, we lob off anything below that (the lower 3 bits are for tile palette)
 
-    nameTable[yPos][xPos] = (flags << 8) | (whatPalette << 8) | whatTile; // Palette points to a grouping of 4 colors, so we shift the palette # 2 to the left to save math during render
+    setNameTable(xPos, yPos, (flags << 8) | (whatPalette << 8) | whatTile); // Palette points to a grouping of 4 colors, so we shift the palette # 2 to the left to save math during render
 }
 
 // In tilemap position X/Y, draw the tile at position tileX to the right, tileY down, from the pattern table using whatPalette (0-7)
@@ -321,7 +620,7 @@ void drawTileXY(int tileX, int tileY, uint16_t patternX, uint16_t patternY, char
 
     uint16_t whatTile = (patternY * 16) + patternX; // Do this math for the user :)
 
-    nameTable[tileY][tileX] = (flags << 8) | (whatPalette << 8) | whatTile; // Palette points to a grouping of 4 colors, so we shift the palette # 2 to the left to save math during render
+    setNameTable(tileX, tileY, (flags << 8) | (whatPalette << 8) | whatTile); // Palette points to a grouping of 4 colors, so we shift the palette # 2 to the left to save math during render
 }
 
 // Sets flags on a tile (blocking, platform, etc). By default drawTile sets these as 0. You must use setTileType after using drawTile
@@ -338,7 +637,7 @@ void setTileType(int tileX, int tileY, int flags)
 void tileDirect(int tileX, int tileY, uint16_t theData)
 { // Copies data directy into tile map
 
-    nameTable[tileY][tileX] = theData;
+    setNameTable(tileX, tileY, theData);
 }
 
 void setTilePalette(int tileX, int tileY, int whatPalette)
@@ -348,9 +647,7 @@ void setTilePalette(int tileX, int tileY, int whatPalette)
 
     whatPalette &= 0x0300; // Ensure it won't overwrite anything else
 
-    nameTable[tileY][tileX] &= 0xF8FF; // Erase those 3 bits from the tile attb
-
-    nameTable[tileY][tileX] |= whatPalette; // OR in new color
+    setNameTable(tileX, tileY, (nameTable[tileY][tileX] & 0xF8FF) | whatPalette); // Erase those 3 bits from the tile attb and OR in new color
 }
 
 // Retrieves the flags set by the function above (bit-shifted back into the low byte) Use this to detect collisions, spikes and stuff
@@ -447,14 +744,14 @@ void drawText(const char *text, uint8_t x, uint8_t y, bool doWrap)
                     if (x == textWrapEdges[1])
                     { // Does this space land on the right margin?
                         // Serial.println("On right margin. Draw space and do CR");
-                        nameTable[y][x] = *text++; // Draw the space...
+                        setNameTable(x, y, *text++); // Draw the space...
                         cr = true;                 // and set carriage return for next char
                     }
                     else
                     { // OK so there is at least 1 character of space after this space " "
                         // Serial.print("Next word='");
                         int charCount = 0;         // Let's count the characters in the next word
-                        nameTable[y][x++] = *text; // Draw the space and advance x
+                        setNameTable(x++, y, *text); // Draw the space and advance x
 
                         /*
                         while (*text == 32)
@@ -500,18 +797,18 @@ void drawText(const char *text, uint8_t x, uint8_t y, bool doWrap)
                     if (*text == ' ')
                     {                              // Single character with a space after? "a ", " I"...
                         text--;                    // Backup pointer
-                        nameTable[y][x] = *text++; // and print it, advancing the pointer again. Next line will see the space and skip it since beginning of line
+                        setNameTable(x, y, *text++); // and print it, advancing the pointer again. Next line will see the space and skip it since beginning of line
                     }
                     else
                     {
-                        nameTable[y][x] = '-'; // Draw a hyphen
+                        setNameTable(x, y, '-'); // Draw a hyphen
                         text--;                // Backup pointer so the character that wasn't ' ' will print on next line
                     }
                     cr = true;
                 }
                 else
                 {
-                    nameTable[y][x++] = *text++; // Standard draw
+                    setNameTable(x++, y, *text++); // Standard draw
                 }
             }
 
@@ -534,8 +831,8 @@ void drawText(const char *text, uint8_t x, uint8_t y, bool doWrap)
     {
         while (*text)
         {
-            nameTable[y][x] &= 0xFF00;    // Retain attb and color bits
-            nameTable[y][x++] |= *text++; // Just draw the characters from left to write
+            setNameTable(x, y, (nameTable[y][x] & 0xFF00) | *text++); // Retain attb and color bits, just draw the characters from left to write
+            x++;
         }
     }
 
@@ -563,13 +860,13 @@ void drawDecimalXY(int32_t theValue, uint8_t x, uint8_t y)
     { // 9 digit number
         if (theValue >= divider)
         {
-            nameTable[y][x++] = '0' + (theValue / divider);
+            setNameTable(x++, y, '0' + (theValue / divider));
             theValue %= divider;
             zPad = 1;
         }
         else if (zPad || divider == 1)
         {
-            nameTable[y][x++] = '0';
+            setNameTable(x++, y, '0');
         }
         divider /= 10;
     }
@@ -674,10 +971,143 @@ void drawSpriteDecimalRight(int32_t theValue, uint8_t xRight, uint8_t y, int wha
     } while (x > -1);
 }
 
+static void queueSprite(int xPos, int yPos, int width, int height, int meta, uint16_t pattern, uint8_t whichPalette, bool hFlip, bool vFlip);
+
+// Composes a tile range into a new metasprite, walking the tiles exactly like drawSpriteRange() does (including which rows
+// a vFlip range reads). Returns the entry, or -1 if the pools are full (the cache is then flushed and refilled)
+static int buildMetasprite(uint16_t tileX, uint16_t tileY, uint16_t xWide, uint16_t yHigh, uint8_t whichPalette, uint8_t flags)
+{
+    int width = xWide << 3;
+    int height = yHigh << 3;
+
+    if (metaCount == METASPRITE_MAX || metaPixelsUsed + (width * height) > METASPRITE_PIXELS)
+    {
+        metaFlush = 1;
+        return -1;
+    }
+
+    Metasprite *meta = &metasprites[metaCount];
+    uint8_t *block = &metaPixels[metaPixelsUsed];
+    int tileYstart = (flags & spriteVFlip) ? tileY + yHigh : tileY;
+    int tileYdir = (flags & spriteVFlip) ? -1 : 1;
+
+    for (int cellY = 0; cellY < yHigh; cellY++)
+    {
+        int yTiles = tileYstart + (cellY * tileYdir);
+
+        for (int cellX = 0; cellX < xWide; cellX++)
+        {
+            int xTiles = (flags & spriteHFlip) ? tileX + (xWide - 1) - cellX : tileX + cellX;
+            uint16_t pattern = (xTiles << 3) + (yTiles << 7);
+
+            for (int line = 0; line < 8; line++)
+            {
+                const uint8_t *pixels = patternPixels[flags & spriteHFlip][pattern + ((flags & spriteVFlip) ? 7 - line : line)];
+                uint8_t *dest = &block[(((cellY << 3) + line) * width) + (cellX << 3)];
+
+                for (int x = 0; x < 8; x++)
+                {
+                    dest[x] = pixels[x] ? (whichPalette << 2) + pixels[x] : 0;
+                }
+            }
+        }
+    }
+
+    int runsUsed = metaRunsUsed;
+
+    for (int line = 0; line < height; line++)
+    { // Find the solid runs of each line
+        const uint8_t *pixels = &block[line * width];
+
+        meta->rowRuns[line] = runsUsed;
+        for (int x = 0; x < width;)
+        {
+            if (pixels[x] == 0)
+            {
+                x++;
+                continue;
+            }
+
+            int start = x;
+            while (x < width && pixels[x] != 0)
+            {
+                x++;
+            }
+            if (runsUsed >= METASPRITE_RUNS - 1)
+            {
+                metaFlush = 1;
+                return -1;
+            }
+            metaRuns[runsUsed].start = start;
+            metaRuns[runsUsed++].length = x - start;
+        }
+        if (runsUsed >= METASPRITE_RUNS)
+        {
+            metaFlush = 1;
+            return -1;
+        }
+        metaRuns[runsUsed].start = 0;
+        metaRuns[runsUsed++].length = 0; // End of line
+    }
+
+    meta->tileX = tileX;
+    meta->tileY = tileY;
+    meta->xWide = xWide;
+    meta->yHigh = yHigh;
+    meta->palette = whichPalette;
+    meta->flags = flags;
+    meta->width = width;
+    meta->height = height;
+    meta->pixels = metaPixelsUsed;
+    metaPixelsUsed += width * height;
+    metaRunsUsed = runsUsed;
+
+    return metaCount++;
+}
+
+// Finds (or builds) the metasprite for a tile range. -1 means draw it tile by tile this time
+static int findMetasprite(uint16_t tileX, uint16_t tileY, uint16_t xWide, uint16_t yHigh, uint8_t whichPalette, uint8_t flags)
+{ // HUD groups can outlive a cache flush, so they always get plain tiles
+    if (metaFlush || hudTarget >= 0 || xWide == 0 || yHigh == 0 || (xWide << 3) > METASPRITE_MAX_WIDTH || (yHigh << 3) > METASPRITE_MAX_HEIGHT)
+    {
+        metaMisses++;
+        return -1;
+    }
+
+    for (int which = 0; which < metaCount; which++)
+    {
+        Metasprite *meta = &metasprites[which];
+
+        if (meta->tileX == tileX && meta->tileY == tileY && meta->xWide == xWide && meta->yHigh == yHigh && meta->palette == whichPalette && meta->flags == flags)
+        {
+            metaHits++;
+            return which;
+        }
+    }
+
+    metaMisses++;
+    return buildMetasprite(tileX, tileY, xWide, yHigh, whichPalette, flags);
+}
+
+// Metasprite cache lookups since boot. A miss is a range that had to be composed (or drawn tile by tile)
+void getMetaspriteStats(uint32_t *hits, uint32_t *misses)
+{
+    *hits = metaHits;
+    *misses = metaMisses;
+}
+
 // Draws a sprite at xPos/yPos using a range of tiles from the pattern table, starting at tileX/Y, ending at xWide/yHigh, using whichpalette and flipped V/H if true
 void drawSpriteRange(int xPos, int yPos, uint16_t tileX, uint16_t tileY, uint16_t xWide, uint16_t yHigh, uint8_t whichPalette, bool hFlip, bool vFlip)
 {
 
+    int meta = findMetasprite(tileX, tileY, xWide, yHigh, whichPalette, (hFlip ? spriteHFlip : 0) | (vFlip ? spriteVFlip : 0));
+
+    if (meta >= 0)
+    { // Whole object in one sprite entry
+        queueSprite(xPos, yPos, xWide << 3, yHigh << 3, meta, 0, whichPalette, false, false);
+        return;
+    }
+
     int tileYstart = tileY;
     int tileYend = tileY + yHigh;
     int tileYdir = 1;
@@ -715,173 +1145,105 @@ void drawSpriteRange(int xPos, int yPos, uint16_t tileX, uint16_t tileY, uint16_
     }
 }
 
-// Draws a single 8x8 sprite at xPos/yPos using a tile from the pattern table at tileX/Y, using whichpalette and flipped V/H if true
-void drawSpriteSingle(int xPos, int yPos, uint16_t tileX, uint16_t tileY, uint8_t whichPalette, bool hFlip, bool vFlip)
+// Places a width x height sprite at xPos/yPos and sets its visible part, clipped to a sprite window and the screen. False if none of it is
+static bool clipSprite(SpriteEntry *entry, int xPos, int yPos, int width, int height, int windowLeft, int windowRight, int windowTop, int windowBottom)
 {
-
-    // gpio_put(15, 1);
-
-    tileX <<= 3;
-    tileY <<= 7;
-
-    int lineYdir = 1; // Normal sprites
-    int vFlipOffset = 0;
-
-    if (vFlip)
-    { // Vertical flip
-        lineYdir = -1;
-        vFlipOffset = 7;
+    int left = xPos > windowLeft + 1 ? xPos : windowLeft + 1; // Window limits are exclusive
+    int right = xPos + width < windowRight ? xPos + width : windowRight;
+    int top = yPos > windowTop + 1 ? yPos : windowTop + 1;
+    int bottom = yPos + height < windowBottom ? yPos + height : windowBottom;
+
+    left = left < 0 ? 0 : left; // The window can be set wider than the screen
+    right = right > FRAME_WIDTH ? FRAME_WIDTH : right;
+    top = top < 0 ? 0 : top;
+    bottom = bottom > FRAME_HEIGHT ? FRAME_HEIGHT : bottom;
+
+    if (left >= right || top >= bottom)
+    { // Nothing visible
+        return false;
     }
+    entry->x = xPos; // Only stored once it's known to be near the screen
+    entry->y = yPos;
+    entry->left = left;
+    entry->right = right;
+    entry->top = top;
+    entry->bottom = bottom;
+    return true;
+}
 
-    if (hFlip)
+// Adds an 8x8 sprite (or a metasprite of width x height) to this frame's list. Clipping against the sprite window happens now, so the renderer only ever sees the visible part
+static void queueSprite(int xPos, int yPos, int width, int height, int meta, uint16_t pattern, uint8_t whichPalette, bool hFlip, bool vFlip)
+{
+    SpriteEntry *entry;
+    SpriteEntry sprite;
+
+    if (!clipSprite(&sprite, xPos, yPos, width, height, xLeft, xRight, yTop, yBottom))
     {
-        uint16_t *sp = &spriteBuffer[(yPos * 120) + xPos]; // Use pointer so less math later on
-        uint16_t *tilePointer = &patternTable[tileX + tileY + vFlipOffset];
+        return;
+    }
 
-        for (int yPixel = yPos; yPixel < (yPos + 8); yPixel++)
+    if (hudTarget >= 0)
+    { // Building a HUD group
+        if (hudGroupCount[hudTarget] == HUD_GROUP_MAX)
         {
-
-            uint16_t temp = *tilePointer; // Get pointer for sprite tile
-
-            for (int xPixel = xPos; xPixel < (xPos + 8); xPixel++)
-            {
-
-                uint8_t twoBits = temp & 0x03; // Get lowest 2 bits
-
-                // For a sprite pixel to be drawn, it must be within the current window, not a 0 index color, and not over an existing sprite pixel
-                if (xPixel > xLeft && xPixel < xRight && yPixel > yTop && yPixel < yBottom && twoBits != 0 && *sp == spriteAlphaColor)
-                {
-                    *sp = paletteRGB[(whichPalette << 2) + twoBits];
-                }
-                sp++;
-                temp >>= 2; // Shift for next 2 bit color pair
-            }
-
-            tilePointer += lineYdir;
-            sp += (120 - 8);
+            return;
         }
+        entry = &hudGroups[hudTarget][hudGroupCount[hudTarget]++];
     }
     else
     {
-        uint16_t *sp = &spriteBuffer[(yPos * 120) + xPos]; // Use pointer so less math later on
-
-        uint16_t *tilePointer = &patternTable[tileX + tileY + vFlipOffset];
-
-        for (int yPixel = yPos; yPixel < (yPos + 8); yPixel++)
-        {
-
-            uint16_t temp = *tilePointer; // Get pointer for sprite tile
-
-            for (int xPixel = xPos; xPixel < (xPos + 8); xPixel++)
-            {
-
-                uint8_t twoBits = temp >> 14; // Smash this down into 2 lowest bits
-
-                // For a sprite pixel to be drawn, it must be within the current window, not a 0 index color, and not over an existing sprite pixel
-                if (xPixel > xLeft && xPixel < xRight && yPixel > yTop && yPixel < yBottom && twoBits != 0 && *sp == spriteAlphaColor)
-                {
-                    *sp = paletteRGB[(whichPalette << 2) + twoBits];
-                }
-                sp++;
-                temp <<= 2; // Shift for next 2 bit color pair
-            }
-
-            tilePointer += lineYdir;
-            sp += (120 - 8);
+        if (spriteCount == SPRITE_MAX)
+        { // Out of sprites
+            return;
         }
+        entry = &spriteList[spriteCount++];
     }
 
-    // gpio_put(15, 0);
+    *entry = sprite;
+    entry->meta = meta;
+    entry->pattern = pattern;
+    entry->palette = whichPalette << 2;
+    entry->flags = (hFlip ? spriteHFlip : 0) | (vFlip ? spriteVFlip : 0);
+}
+
+// Draws a single 8x8 sprite at xPos/yPos using a tile from the pattern table at tileX/Y, using whichpalette and flipped V/H if true
+void drawSpriteSingle(int xPos, int yPos, uint16_t tileX, uint16_t tileY, uint8_t whichPalette, bool hFlip, bool vFlip)
+{
+    queueSprite(xPos, yPos, 8, 8, -1, (tileX << 3) + (tileY << 7), whichPalette, hFlip, vFlip);
 }
 
 // Draws a single 8x8 sprite at xPos/yPos using whichTile # from the pattern table, using whichpalette and flipped V/H if true
 void drawSpriteTile(int xPos, int yPos, uint16_t whichTile, uint8_t whichPalette, bool hFlip, bool vFlip)
 {
+    queueSprite(xPos, yPos, 8, 8, -1, whichTile << 3, whichPalette, hFlip, vFlip);
+}
 
-    // gpio_put(15, 1);
-
-    whichTile <<= 3; // Multiple by 8
-
-    int lineYdir = 1; // Normal sprites
-    int vFlipOffset = 0;
-
-    if (vFlip)
-    { // Vertical flip
-        lineYdir = -1;
-        vFlipOffset = 7;
-    }
-
-    if (hFlip)
-    {
-        uint16_t *sp = &spriteBuffer[(yPos * 120) + xPos]; // Use pointer so less math later on
-        uint16_t *tilePointer = &patternTable[whichTile + vFlipOffset];
-
-        for (int yPixel = yPos; yPixel < (yPos + 8); yPixel++)
-        {
-
-            uint16_t temp = *tilePointer; // Get pointer for sprite tile
-
-            for (int xPixel = xPos; xPixel < (xPos + 8); xPixel++)
-            {
-
-                uint8_t twoBits = temp & 0x03; // Get lowest 2 bits
-
-                // For a sprite pixel to be drawn, it must be within the current window, not a 0 index color, and not over an existing sprite pixel
-                if (xPixel > xLeft && xPixel < xRight && yPixel > yTop && yPixel < yBottom && twoBits != 0 && *sp == spriteAlphaColor)
-                {
-                    *sp = paletteRGB[(whichPalette << 2) + twoBits];
-                }
-                sp++;
-                temp >>= 2; // Shift for next 2 bit color pair
-            }
-
-            tilePointer += lineYdir;
-            sp += (120 - 8);
-        }
-    }
-    else
-    {
-        uint16_t *sp = &spriteBuffer[(yPos * 120) + xPos]; // Use pointer so less math later on
-
-        uint16_t *tilePointer = &patternTable[whichTile + vFlipOffset];
-
-        for (int yPixel = yPos; yPixel < (yPos + 8); yPixel++)
-        {
-
-            uint16_t temp = *tilePointer; // Get pointer for sprite tile
-
-            for (int xPixel = xPos; xPixel < (xPos + 8); xPixel++)
-            {
-
-                uint8_t twoBits = temp >> 14; // Smash this down into 2 lowest bits
-
-                // For a sprite pixel to be drawn, it must be within the current window, not a 0 index color, and not over an existing sprite pixel
-                if (xPixel > xLeft && xPixel < xRight && yPixel > yTop && yPixel < yBottom && twoBits != 0 && *sp == spriteAlphaColor)
-                {
-                    *sp = paletteRGB[(whichPalette << 2) + twoBits];
-                }
-                sp++;
-                temp <<= 2; // Shift for next 2 bit color pair
-            }
+// Starts redrawing a HUD group. Sprites drawn until hudEnd() go into the group instead of this frame, and stay there for
+// every frame the group is shown, so status displays only need redrawing when what they show changes
+void hudBegin(int group)
+{
+    hudTarget = group;
+    hudGroupCount[group] = 0;
+}
 
-            tilePointer += lineYdir;
-            sp += (120 - 8);
-        }
-    }
+void hudEnd()
+{
+    hudTarget = -1;
+    hudChanged = true;
+}
 
-    // gpio_put(15, 0);
+// Shows a HUD group this frame. HUD groups draw over every sprite, lowest group first
+void hudShow(int group)
+{
+    hudVisible |= 1 << group;
 }
 
-// Wipes entire sprite buffer with the transparent color
+// Removes every sprite drawn so far this frame
 void clearSprite()
 {
 
-    for (int x = 0; x < 14400; x++)
-    {
-        spriteBuffer[x] = spriteAlphaColor; // spriteAlphaColor;
-    }
-    // The sprite buffer is cleared as each frame is rendered so user doesn't need to run this every frame, it's best for setup/boot purposes
-    // Once frameDrawing == false you can be assured the sprite buffer has been cleared during render and is ready to be filled with the next frame of data
+    spriteCount = 0;
+    // Sprites are drawn fresh each frame so user doesn't need to run this every frame, it's best for setup/boot purposes
 }
 
 // Converts the 2 bitplane YY-CHR NES graphics to chunky pixels in Pico memory (done on pattern load)
@@ -893,8 +1255,6 @@ void convertBitplanePattern(uint16_t position, unsigned char *lowBitP, unsigned
         unsigned char lowBit = lowBitP[xx]; // Get temps
         unsigned char highBit = highBitP[xx];
 
-        uint16_t tempShort = 0;
-
         for (int g = 0; g < 8; g++) // 2 bits at a time
         {
             unsigned char bits = ((lowBit & 0x80) >> 1) | (highBit & 0x80); // Build 2 bits from 2 pairs of MSB in bytes (the bitplanes)
@@ -904,12 +1264,17 @@ void convertBitplanePattern(uint16_t position, unsigned char *lowBitP, unsigned
 
             bits >>= 6; // Shift into LSB
 
-            tempShort <<= 2; // Free up 2 bits at bottom
-
-            tempShort |= bits;
+            patternPixels[0][position][g] = bits;
+            patternPixels[1][position][7 - g] = bits; // Mirrored copy, so flipped sprites read forward like the rest
         }
 
-        patternTable[position++] = tempShort; // Put combined bitplane bytes as a short into buffer (we send this to new file)
+        position++;
+    }
+
+    patternDirty = true;
+    if (metaFlush == 0)
+    {
+        metaFlush = 1; // Cached metasprites were built from the old patterns
     }
 }
 
@@ -997,219 +1362,930 @@ void setWindowSlice(int whichRow, uint8_t x)
     // Use setWindow to set main window, then use this to control individual rows. For status displays, set their scroll to a fixed 0 so they don't move with rest of screen
 }
 
-// Sets which tile map rows are the bounderies for vertical scrolling rollover. 0-31 use whole nametable, 2-31, use top 2 rows as a static display, 0-29, use bottom 2 rows of a static display (see setWinYjump)
-void setCoarseYRollover(int topRow, int bottomRow)
-{ // Sets at which row the nametable resets back to the top. If using bottom 2 rows as a status display
-
-    winYreset = topRow;
-    winYrollover = bottomRow;
-
-    // When you scroll far enough down in the nametable where there isn't enough data to draw, it will "roll over" back to the top (just like the NES)
-    // This is why once you've scrolled 239 pixels left or right up or down you should reset your window back to 0
-    // But until you reach that limit, gamebadge will display the "rolled over" pixels. In the case of vertical scroll, which this function
-    // controls, once row 31 is drawn any additional rows on the display revert back to row 0 (rollover)
-    // By default the rollover uses the entire vertical display (32 rows) but if you're using static rows for status bars (in conjunction with setWinYjump) you'll want
-    // to use this function to change the rollover to only include valid background data (not status bars)
+// Scrolls one display line (0-119) horizontally on its own, for effects finer than setWindowSlice's 8 pixel rows (heat shimmer, wavy water, gradient parallax)
+void setRasterScrollX(int line, uint8_t x)
+{
+    setRasterScrollXRange(line, line, x);
 }
 
-int lcdState = 0;
-bool localFrameDrawFlag = false;
-volatile bool lcdDMAcomplete = false;
-bool isRendering = false; // Render status flag 0 = null true = render in progress false = render complete
-
-int whichBuffer = 0; // We have 2 row buffers. We draw one, send via DMA, and draw next while DMA is running
-int lastDMA = 5;     // Round-robin the DMA's
-
-uint8_t fineYsubCount = 0;
-uint8_t fineYpointer; // = winYfine;
-uint8_t coarseY;      // = winY;
-uint16_t *sp;         // = &spriteBuffer[0];
-uint8_t *pp;          // = &playfield[0];
+// Scrolls display lines first to last (inclusive) by the same amount in one call, for parallax strips a few rows high
+void setRasterScrollXRange(int first, int last, uint8_t x)
+{
+    if (first < 0)
+    { // Clipped to the display
+        first = 0;
+    }
+    if (last >= FRAME_HEIGHT)
+    {
+        last = FRAME_HEIGHT - 1;
+    }
+    for (int line = first; line <= last; line++)
+    {
+        RasterLine *effect = &rasterLines[line];
 
-uint8_t renderRow = 0;
+        if ((effect->flags & rasterScrollX) && effect->winX == x >> 3 && effect->winXfine == (x & 0x07))
+        { // Already there, nothing to redraw
+            continue;
+        }
+        effect->flags |= rasterScrollX;
+        effect->winX = x >> 3;
+        effect->winXfine = x & 0x07;
+        rasterBands |= 1 << (line >> 3);
+        rasterDirty = true;
+    }
+}
 
-uint8_t scrollYflag = 0;
+// Makes a display line start reading nametable row y >> 3, pattern line y & 7. The lines below it continue from there
+// (and still roll over per setCoarseYRollover) until the next jump, so this also works as a mid-screen vertical scroll split
+void setRasterJumpY(int line, uint8_t y)
+{
 
-bool LCDupdatePause = false;
+    if (line < 0 || line >= FRAME_HEIGHT)
+    {
+        return;
+    }
+    if ((rasterLines[line].flags & rasterJumpY) && rasterLines[line].jumpRow == ((y >> 3) & 0x1F) && rasterLines[line].jumpFine == (y & 0x07))
+    { // Already there, nothing to redraw
+        return;
+    }
+    rasterLines[line].flags |= rasterJumpY;
+    rasterLines[line].jumpRow = (y >> 3) & 0x1F;
+    rasterLines[line].jumpFine = y & 0x07;
+    rasterBands |= 1 << (line >> 3);
+    rasterDirty = true;
+}
 
-void pauseLCD(bool state)
-{ // Prevents the LCD from drawing a new frame (hold on old frame) Useful for loading new graphics/game transitions
+// Shifts the background palettes of one display line, bank (0-7) is XOR'd into each tile's palette number. Sprites are not affected
+void setRasterPalette(int line, uint8_t bank)
+{
 
-    LCDupdatePause = state;
+    if (line < 0 || line >= FRAME_HEIGHT)
+    {
+        return;
+    }
+    if ((rasterLines[line].flags & rasterPalette) && rasterLines[line].paletteBank == ((bank & 0x07) << 2))
+    { // Already there, nothing to redraw
+        return;
+    }
+    rasterLines[line].flags |= rasterPalette;
+    rasterLines[line].paletteBank = (bank & 0x07) << 2;
+    rasterBands |= 1 << (line >> 3);
+    rasterDirty = true;
 }
 
+// Removes every raster effect, the display goes back to per row scrolling only. Settings stay until cleared, like the scroll registers
+void clearRaster()
+{
+
+    if (rasterBands == 0)
+    {
+        return;
+    }
+    memset(rasterLines, 0, sizeof(rasterLines));
+    rasterBands = 0;
+    rasterDirty = true;
+}
+
+// Sets which tile map rows are the bounderies for vertical scrolling rollover. 0-31 use whole nametable, 2-31, use top 2 rows as a static display, 0-29, use bottom 2 rows of a static display (see setWinYjump)
+void setCoarseYRollover(int topRow, int bottomRow)
+{ // Sets at which row the nametable resets back to the top. If using bottom 2 rows as a status display
+
+    winYreset = topRow;
+    winYrollover = bottomRow;
+
+    // When you scroll far enough down in the nametable where there isn't enough data to draw, it will "roll over" back to the top (just like the NES)
+    // This is why once you've scrolled 239 pixels left or right up or down you should reset your window back to 0
+    // But until you reach that limit, gamebadge will display the "rolled over" pixels. In the case of vertical scroll, which this function
+    // controls, once row 31 is drawn any additional rows on the display revert back to row 0 (rollover)
+    // By default the rollover uses the entire vertical display (32 rows) but if you're using static rows for status bars (in conjunction with setWinYjump) you'll want
+    // to use this function to change the rollover to only include valid background data (not status bars)
+}
+
+bool localFrameDrawFlag = false;
+
+static RenderBand bands[15]; // One per tile row of the display, each can be rendered on its own
+
+static uint32_t *lastFrame = NULL; // Where the last frame was rendered. Bands that didn't change are copied from it instead of composited again
+static int lastStride = 0;
+static bool lastIndexed = false;
+static uint8_t lastCoarseY[15]; // Where each band read the nametable last frame
+static uint8_t lastFineY[15];
+static uint16_t lastSpriteBands = 0; // Bands sprites were drawn over last frame, they have to be redrawn once more to erase them
+static uint32_t rowsReused = 0;      // Display lines copied from the last frame instead of rendered
+static uint32_t framesUnchanged = 0; // Frames with nothing to draw, not rendered or presented at all
+
+int renderKernel = kernelScalar; // Which compositing kernel RenderRow is using
+
+static uint8_t indexFrame[FRAME_HEIGHT][FRAME_WIDTH]; // The last frame as paletteRGB indexes, when indexedFrame is on
+static bool indexedFrame = false;
+
+// Band worker pool. drawPlayfield renders bands too, so 1 thread means no pool at all (the serial renderer)
+static pthread_t renderThreads[RENDER_MAX_THREADS];
+static int renderThreadCount = 1;
+static pthread_mutex_t bandMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bandStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t bandFinish = PTHREAD_COND_INITIALIZER;
+static int bandGeneration = 0; // Bumped once per frame to wake the pool
+static int bandWorkersDone = 0;
+static bool bandWorkersQuit = false;
+static volatile gint nextBand = 15; // Next band nobody has claimed yet
+
 bool getRenderStatus()
 { // Core0 calls this to see if rendering is done, and when done Core0 runs logic
-    return isRendering;
+    return false; // The renderer works from its own snapshot, so video memory is free as soon as snapshotVideo() returns
 }
 
-void drawLineOfPlayfield(const uint16_t *data, int whatSize)
+// Copies the video state the renderer reads and hands it the sprite buffer logic just filled. Call once logic has finished
+// a frame and the previous frame's render is done (the renderer must be done with the old sprite buffer before logic gets it back)
+void snapshotVideo()
 {
-    for (int i = 0; i < whatSize; i++)
+    uint32_t lastPalette[64];
+
+    if (interpolation)
+    { // Keep where things were for drawPlayfieldBlend, before they're overwritten
+        for (int row = 0; row < 32; row++)
+        {
+            video.fromX[row] = (video.winX[row] << 3) | video.winXfine[row];
+        }
+        for (int line = 0; line < FRAME_HEIGHT; line++)
+        {
+            video.fromRasterX[line] = (video.raster[line].winX << 3) | video.raster[line].winXfine;
+        }
+        video.fromCount = 0;
+        if (video.sprites)
+        { // None before the first snapshot
+            video.fromCount = video.spriteCount;
+            memcpy(video.fromSprites, video.sprites, video.fromCount * sizeof(SpriteEntry));
+        }
+    }
+
+    if (fadeType == fadeOut || fadeType == fadeBlack)
+    { // Leaving a scene. Keep the picture it ended on and only fade its colors. Tile, pattern and scroll changes wait for
+      // the next full snapshot, sprites and HUD groups are drawn again by then anyway
+        memcpy(lastPalette, video.paletteRGB, sizeof(lastPalette));
+        applyFade();
+        video.paletteChanged |= memcmp(lastPalette, video.paletteRGB, sizeof(lastPalette)) != 0;
+        hudVisible = 0;
+        spriteCount = 0;
+        localFrameDrawFlag = false;
+        return;
+    }
+
+    video.rowsChanged |= nameRowDirty;
+    video.redrawAll |= patternDirty || rasterDirty || video.winYreset != winYreset || video.winYrollover != winYrollover;
+    for (int row = 0; row < 32; row++)
+    {
+        if (nameRowDirty & (1u << row))
+        { // Only the rows logic wrote to
+            memcpy(video.nameTable[row], nameTable[row], sizeof(video.nameTable[row]));
+        }
+        if (video.winX[row] != winX[row] || video.winXfine[row] != winXfine[row])
+        {
+            video.rowsChanged |= 1u << row;
+        }
+    }
+    nameRowDirty = 0;
+    if (patternDirty)
+    {
+        memcpy(video.patternPixels, patternPixels, sizeof(video.patternPixels));
+        patternDirty = false;
+    }
+    memcpy(lastPalette, video.paletteRGB, sizeof(lastPalette));
+    memcpy(video.paletteRGB, paletteRGB, sizeof(video.paletteRGB));
+    applyFade();
+    video.paletteChanged |= memcmp(lastPalette, video.paletteRGB, sizeof(lastPalette)) != 0;
+    memcpy(video.winX, winX, sizeof(video.winX));
+    memcpy(video.winXfine, winXfine, sizeof(video.winXfine));
+    video.winY = winY;
+    video.winYfine = winYfine;
+    memcpy(video.winYJumpList, winYJumpList, sizeof(video.winYJumpList));
+    video.winYreset = winYreset;
+    video.winYrollover = winYrollover;
+    if (rasterDirty)
+    {
+        memcpy(video.raster, rasterLines, sizeof(video.raster));
+        video.rasterBands = rasterBands;
+        rasterDirty = false;
+    }
+
+    video.sprites = spriteList;
+    video.spriteCount = spriteCount;
+    video.xLeft = xLeft;
+    video.xRight = xRight;
+    video.yTop = yTop;
+    video.yBottom = yBottom;
+
+    if (hudChanged || hudVisible != hudSnapshotVisible)
     {
-        uint16_t rgb565 = *data++;
-        uint8_t r = (rgb565 & 0xF800) >> 8;
-        uint8_t g = (rgb565 & 0x07E0) >> 3;
-        uint8_t b = (rgb565 & 0x001F) << 3;
-        *pp++ = r;
-        *pp++ = g;
-        *pp++ = b;
+        video.hudCount = 0;
+        for (int group = 0; group < HUD_GROUPS; group++)
+        {
+            if (hudVisible & (1 << group))
+            {
+                memcpy(&video.hud[video.hudCount], hudGroups[group], hudGroupCount[group] * sizeof(SpriteEntry));
+                video.hudCount += hudGroupCount[group];
+            }
+        }
+        hudSnapshotVisible = hudVisible;
+        hudChanged = false;
+    }
+    hudVisible = 0; // Groups have to be shown again each frame, like sprites are drawn again each frame
+
+    if (metaFlush == 2)
+    { // The renderer is done with the last frame that could use the old entries, reuse their space
+        metaCount = 0;
+        metaPixelsUsed = 0;
+        metaRunsUsed = 0;
+        metaFlush = 0;
+    }
+    else if (metaFlush == 1)
+    { // The frame just snapshotted may still draw old entries, so keep them one more frame
+        metaFlush = 2;
     }
+    spriteList = (spriteList == spriteLists[0]) ? spriteLists[1] : spriteLists[0];
+    spriteCount = 0; // Sprites are redrawn every frame
+
+    localFrameDrawFlag = false;
 }
 
-void drawPlayfield()
+// Drops the frame logic just finished instead of snapshotting it, for when the scheduler is behind and skips rendering to catch up.
+// Tile, scroll and palette changes carry over to the next snapshot, sprites and HUD groups get drawn again next frame anyway
+void skipFrame()
 {
+    stepFade(); // Fades take as long as they would have
+    hudVisible = 0;
+    spriteCount = 0;
     localFrameDrawFlag = false;
-    fineYsubCount = 0; // This is stuff we used to setup in sendframe
-    fineYpointer = winYfine;
-    coarseY = winY;
-    sp = &spriteBuffer[0]; // Use pointer so less math later on
-    pp = &playfield[0];
-    renderRow = 0;
-    scrollYflag = 0;
-    isRendering = true;
+}
 
-    while (isRendering)
-    {
-        RenderRow();
-        drawLineOfPlayfield(&linebuffer[whichBuffer][0], 3840);
+bool LCDgetDrawFlag()
+{ // The presenter calls this to see if logic has a new frame ready to draw
+    return localFrameDrawFlag;
+}
 
-        if (++whichBuffer > 1)
-        { // Switch up buffers, we will draw the next while the prev is being DMA'd to LCD
-            whichBuffer = 0;
+// Fills dest with the palette index (0bPPPbb) of every background pixel on tilemap row tileY, pattern line fineY, starting at tile column tileX
+static void expandPatternLine(uint8_t *dest, uint8_t tileY, uint8_t fineY, uint8_t tileX)
+{
+    uint16_t *tilePointer = &video.nameTable[tileY][tileX]; // Get pointer for this character line
+    uint8_t winXtemp = tileX;                               // Temp copy for finding edge of tilemap and rolling back over
+
+    for (int xChar = 0; xChar < 16; xChar++)
+    { // 15 characters wide, plus one for fine scroll
+        uint64_t pixels;
+        uint64_t palette = ((*tilePointer & 0x700) >> 6) * 0x0101010101010101ULL; // Palette index in all 8 bytes so one OR colors the whole tile line
+
+        memcpy(&pixels, video.patternPixels[0][((*tilePointer & 0x00FF) << 3) + fineY], 8); // Already decoded, just copy the span
+        pixels |= palette;
+        memcpy(dest, &pixels, 8);
+        dest += 8;
+
+        tilePointer++; // Advance tile pointer in memory
+        if (++winXtemp == 32)
+        {                      // Rollover edge of tiles X?
+            tilePointer -= 32; // Roll tile X pointer back 32
         }
+    }
+}
+
+// Colors one line of paletteRGB indexes (background with the sprites already drawn in)
+static void resolveLineScalar(uint32_t *dest, const uint8_t *bg)
+{
+    for (int x = 0; x < FRAME_WIDTH; x++)
+    {
+        dest[x] = video.paletteRGB[bg[x]];
+    }
+}
+
+#ifdef RENDER_X86
+// Colors 8 pixels per step. Indexes only reach 63 (16 palettes x 4 colors), so the palette fits in 8 registers and the
+// lookup is in-register permutes + blends, which beats a gather on most cores. Lines with no sprite palettes (index 32 and
+// up, nearly all of them) skip the top half. Only this function is built for AVX2 (the build has no -mavx2), and
+// setRenderKernel only picks it when the CPU reports AVX2. Background and sprite drawing are plain C on every kernel
+__attribute__((target("avx2"))) static void resolveLineAVX2(uint32_t *dest, const uint8_t *bg)
+{
+    const __m256 palette0 = _mm256_loadu_ps((const float *)&video.paletteRGB[0]); // Colors 0-7
+    const __m256 palette1 = _mm256_loadu_ps((const float *)&video.paletteRGB[8]); // Colors 8-15
+    const __m256 palette2 = _mm256_loadu_ps((const float *)&video.paletteRGB[16]);
+    const __m256 palette3 = _mm256_loadu_ps((const float *)&video.paletteRGB[24]);
 
-        if (++renderRow == 15)
-        {                    // LCD done?
-            isRendering = 0; // Render complete, wait for next draw flag (this keeps Core0 from drawing in screen
+    for (int x = 0; x < FRAME_WIDTH; x += 8)
+    {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&bg[x]));
+        __m256 bit3 = _mm256_castsi256_ps(_mm256_slli_epi32(index, 28)); // Blend picks on the sign bit, so move index bits 3, 4 and 5 up there
+        __m256 bit4 = _mm256_castsi256_ps(_mm256_slli_epi32(index, 27));
+        __m256 bit5 = _mm256_castsi256_ps(_mm256_slli_epi32(index, 26));
+        __m256 low = _mm256_blendv_ps(_mm256_permutevar8x32_ps(palette0, index), _mm256_permutevar8x32_ps(palette1, index), bit3);
+        __m256 high = _mm256_blendv_ps(_mm256_permutevar8x32_ps(palette2, index), _mm256_permutevar8x32_ps(palette3, index), bit3);
+        __m256 colors = _mm256_blendv_ps(low, high, bit4);
+
+        if (_mm256_movemask_ps(bit5))
+        { // Sprite palette in here
+            const __m256 palette4 = _mm256_loadu_ps((const float *)&video.paletteRGB[32]);
+            const __m256 palette5 = _mm256_loadu_ps((const float *)&video.paletteRGB[40]);
+            const __m256 palette6 = _mm256_loadu_ps((const float *)&video.paletteRGB[48]);
+            const __m256 palette7 = _mm256_loadu_ps((const float *)&video.paletteRGB[56]);
+
+            low = _mm256_blendv_ps(_mm256_permutevar8x32_ps(palette4, index), _mm256_permutevar8x32_ps(palette5, index), bit3);
+            high = _mm256_blendv_ps(_mm256_permutevar8x32_ps(palette6, index), _mm256_permutevar8x32_ps(palette7, index), bit3);
+            colors = _mm256_blendv_ps(colors, _mm256_blendv_ps(low, high, bit4), bit5);
         }
+
+        _mm256_storeu_ps((float *)&dest[x], colors);
     }
 }
+#endif
 
-void RenderRow()
+static void (*resolveLine)(uint32_t *, const uint8_t *) = resolveLineScalar;
+
+// Draws one line of one sprite into a line of paletteRGB indexes, skipping pixels an earlier sprite already owns. hFlip sprites read the mirrored pattern
+// copy and vFlip only changes which line is read, so every sprite goes through this one forward reading kernel
+static void spriteLine(uint8_t *dest, uint8_t *covered, const SpriteEntry *entry, int line)
 {
+    if (entry->meta >= 0)
+    { // Cached metasprite, only its solid runs are visited
+        const Metasprite *meta = &metasprites[entry->meta];
+        const uint8_t *pixels = &metaPixels[meta->pixels + ((line - entry->y) * meta->width)];
 
-    uint16_t temp;
-    uint16_t tempPalette;
+        for (const MetaspriteRun *run = &metaRuns[meta->rowRuns[line - entry->y]]; run->length; run++)
+        {
+            int start = entry->x + run->start;
+            int end = start + run->length;
 
-    uint16_t *pointer = &linebuffer[whichBuffer][0]; // Use pointer so less math later on
+            start = start < entry->left ? entry->left : start;
+            end = end > entry->right ? entry->right : end;
+            for (int x = start; x < end; x++)
+            {
+                if (covered[x] == 0)
+                {
+                    covered[x] = 1;
+                    dest[x] = pixels[x - entry->x];
+                }
+            }
+        }
+        return;
+    }
 
-    // gpio_put(27, 1);
+    int row = (entry->flags & spriteVFlip) ? 7 - (line - entry->y) : line - entry->y;
+    const uint8_t *pixels = video.patternPixels[entry->flags & spriteHFlip][entry->pattern + row];
+    uint8_t palette = entry->palette;
 
-    if (winYJumpList[renderRow] & 0x80)
-    {                                             // Flag to jump to a different row in the nametable? (like for a status bar)
-        coarseY = winYJumpList[renderRow] & 0x1F; // Jump to row indicated by bottom 5 bits
-        fineYpointer = 0;                         // Reset fine pointer so any following rows are static
+    if (entry->left == entry->x && entry->right == entry->x + 8)
+    { // Whole line visible (the usual case), no bounds and no branches
+        dest += entry->x;
+        covered += entry->x;
+
+        for (int x = 0; x < 8; x++)
+        {
+            uint8_t color = pixels[x];
+            uint8_t take = (color != 0) & (covered[x] ^ 1); // Solid and nobody got here first?
+            uint8_t keep = 0 - take;                        // All ones to take the sprite pixel
+
+            dest[x] = ((palette + color) & keep) | (dest[x] & ~keep);
+            covered[x] |= take;
+        }
     }
     else
-    { // Not a jump line?
-        if (scrollYflag == 0)
-        {                            // Is this first line with fine Y scroll enabled? (under a status bar at the top perhaps)
-            scrollYflag = 1;         // Set flag so this only happens once
-            fineYpointer = winYfine; // Get Y scroll value
-            coarseY = winY;
-        }
-    }
-
-    for (int yLine = 0; yLine < 16; yLine++)
-    { // Each char line is 16 pixels in ST7789 memory, so we send each vertical line twice
-
-        uint8_t fineXPointer = winXfine[coarseY];                           // Copy the fine scrolling amount so we can use it as a byte pointer when scanning in graphics
-        uint16_t *tilePointer = &nameTable[coarseY][winX[coarseY]];         // Get pointer for this character line
-        uint8_t winXtemp = winX[coarseY];                                   // Temp copy for finding edge of tilemap and rolling back over
-        temp = patternTable[((*tilePointer & 0x00FF) << 3) + fineYpointer]; // Get first line of pattern
-        temp <<= (fineXPointer << 1);                                       // Pre-shift for horizontal scroll
-
-        tempPalette = (*tilePointer & 0x700) >> 6; // Palette is lower 3 bits of upper word. Mask and shift 6 to the right to get the palette index 0bxxxPPPbb P = palette pointer b = bits (the 4 colors per palette)
-
-        if (yLine & 0x01)
-        {              // Drawing odd line on LCD/second line of fat pixels?
-            sp -= 120; // Revert sprite buffer point to draw every line twice
-            for (int xChar = 0; xChar < 120; xChar++)
-            { // 15 characters wide
-
-                uint8_t twoBits = temp >> 14; // Smash this down into 2 lowest bits
-                if (*sp == spriteAlphaColor)
-                {                                                           // Transparent sprite pixel? Draw background color...
-                    uint16_t tempShort = paletteRGB[tempPalette | twoBits]; // Add those 2 bits to palette index to get color (0-3)
-                    // uint16_t tempShort = paletteRGB[(*tilePointer >> 8) | twoBits];	//Add those 2 bits to palette index to get color (0-3)
-                    *pointer++ = tempShort; //...twice (fat pixels)
-                    *pointer++ = tempShort;
-                }
-                else
-                {                     // Else draw sprite pixel...
-                    *pointer++ = *sp; //..twice (fat pixels)
-                    *pointer++ = *sp;
-                }
-                *sp = spriteAlphaColor; // When rendering the doubled sprite line, erase it so it's empty for next frame
-                sp++;
-                temp <<= 2; // Shift for next 2 bit color pair
-
-                if (++fineXPointer == 8)
-                { // Advance fine scroll count and jump to next char if needed
-                    fineXPointer = 0;
-                    tilePointer++; // Advance tile pointer in memory
-                    if (++winXtemp == 32)
-                    {                      // Rollover edge of tiles X?
-                        tilePointer -= 32; // Roll tile X pointer back 32
-                    }
-                    temp = patternTable[((*tilePointer & 0x00FF) << 3) + fineYpointer]; // Fetch next line from pattern table
-                    tempPalette = (*tilePointer & 0x700) >> 6;                          // Palette is lower 3 bits of upper word. Mask and shift 6 to the right to get the palette index 0bxxxPPPbb P = palette pointer b = bits (the 4 colors per palette)
-                }
+    { // Clipped by the screen edge or sprite window
+        for (int x = entry->left; x < entry->right; x++)
+        {
+            uint8_t color = pixels[x - entry->x];
+
+            if (color != 0 && covered[x] == 0)
+            {
+                covered[x] = 1;
+                dest[x] = palette + color;
+            }
+        }
+    }
+}
+
+// Draws the sprites crossing one display line over the background, in the order logic drew them. Each pixel takes the first
+// sprite with a solid color there, the same priority the old sprite plane gave by refusing to overwrite
+static void drawSpriteLine(uint8_t *dest, int line, const SpriteEntry *const *visible, int count)
+{
+    uint8_t covered[FRAME_WIDTH]; // Pixels an earlier sprite already owns
+
+    memset(covered, 0, sizeof(covered));
+
+    for (int which = 0; which < count; which++)
+    {
+        const SpriteEntry *entry = visible[which];
+
+        if (line >= entry->top && line < entry->bottom)
+        {
+            spriteLine(dest, covered, entry, line);
+        }
+    }
+}
+
+// Picks the compositing kernel. Asking for a kernel the CPU doesn't support falls back to scalar. The output is identical either way
+void setRenderKernel(int whichKernel)
+{
+    renderKernel = kernelScalar;
+    resolveLine = resolveLineScalar;
+
+#ifdef RENDER_X86
+    __builtin_cpu_init(); // cpuid, only does the work once
+
+    if (whichKernel >= kernelAVX2 && __builtin_cpu_supports("avx2"))
+    {
+        renderKernel = kernelAVX2;
+        resolveLine = resolveLineAVX2;
+    }
+#endif
+}
+
+// Claims and renders bands until there are none left. Runs on drawPlayfield's thread and every pool thread at once
+static void renderBands()
+{
+    int which;
+
+    while ((which = g_atomic_int_add(&nextBand, 1)) < 15)
+    {
+        RenderRow(&bands[which]);
+    }
+}
+
+static void *renderThread(void *ptr)
+{
+    int seenGeneration = 0;
+
+    pthread_mutex_lock(&bandMutex);
+    while (1)
+    {
+        while (bandGeneration == seenGeneration && bandWorkersQuit == false)
+        {
+            pthread_cond_wait(&bandStart, &bandMutex);
+        }
+        if (bandWorkersQuit)
+        {
+            break;
+        }
+        seenGeneration = bandGeneration;
+        pthread_mutex_unlock(&bandMutex);
+
+        renderBands();
+
+        pthread_mutex_lock(&bandMutex);
+        if (++bandWorkersDone == renderThreadCount - 1)
+        {
+            pthread_cond_signal(&bandFinish);
+        }
+    }
+    pthread_mutex_unlock(&bandMutex);
+
+    return NULL;
+}
+
+// Sets how many threads render bands, including the one calling drawPlayfield (1 = serial). Don't call while a frame is rendering
+void setRenderThreads(int count)
+{
+    if (count < 1)
+    {
+        count = 1;
+    }
+    if (count > RENDER_MAX_THREADS)
+    {
+        count = RENDER_MAX_THREADS;
+    }
+
+    pthread_mutex_lock(&bandMutex); // Stop the old pool, if there is one
+    bandWorkersQuit = true;
+    pthread_cond_broadcast(&bandStart);
+    pthread_mutex_unlock(&bandMutex);
+    for (int x = 1; x < renderThreadCount; x++)
+    {
+        pthread_join(renderThreads[x], NULL);
+    }
+
+    bandWorkersQuit = false;
+    bandGeneration = 0;
+    renderThreadCount = count;
+    for (int x = 1; x < renderThreadCount; x++)
+    {
+        pthread_create(&renderThreads[x], NULL, renderThread, NULL);
+    }
+}
+
+int getRenderThreads()
+{
+    return renderThreadCount;
+}
+
+// Renders the last snapshotVideo() straight into the presenter's pixels (XRGB8888, stride in bytes like a cairo image surface)
+// Only touches the snapshot, so it can run on another thread while logic works on the next frame
+// Returns false if the snapshot looks exactly like the last frame rendered. frame is left alone then, keep showing the last one
+bool drawPlayfield(uint32_t *frame, int stride)
+{
+    uint8_t fineYpointer = video.winYfine; // This is stuff we used to setup in sendframe
+    uint8_t coarseY = video.winY;
+    bool scrollYflag = false;
+    int ppStride = stride / sizeof(uint32_t);
+    uint16_t spriteBands = 0;
+    bool reusable = lastFrame != NULL && stride == lastStride && indexedFrame == lastIndexed && !video.redrawAll && !(video.paletteChanged && !indexedFrame); // An indexed frame only has to be colored again
+    int bandsRendered = 0;
+    bool recolor;
+
+    for (int which = 0; which < video.hudCount; which++)
+    {
+        spriteBands |= ((1u << ((video.hud[which].bottom + 7) >> 3)) - 1) & ~((1u << (video.hud[which].top >> 3)) - 1);
+    }
+    for (int which = 0; which < video.spriteCount; which++)
+    { // Every band from the one holding the sprite's top line to the one holding its bottom line
+        spriteBands |= ((1u << ((video.sprites[which].bottom + 7) >> 3)) - 1) & ~((1u << (video.sprites[which].top >> 3)) - 1);
+    }
+
+    for (int renderRow = 0; renderRow < 15; renderRow++)
+    { // Walk the tile rows like the serial renderer did to find where each band starts reading the nametable
+
+        if (video.winYJumpList[renderRow] & 0x80)
+        {                                                   // Flag to jump to a different row in the nametable? (like for a status bar)
+            coarseY = video.winYJumpList[renderRow] & 0x1F; // Jump to row indicated by bottom 5 bits
+            fineYpointer = 0;                               // Reset fine pointer so any following rows are static
+        }
+        else
+        { // Not a jump line?
+            if (scrollYflag == false)
+            {                                  // Is this first line with fine Y scroll enabled? (under a status bar at the top perhaps)
+                scrollYflag = true;            // Set flag so this only happens once
+                fineYpointer = video.winYfine; // Get Y scroll value
+                coarseY = video.winY;
             }
         }
+
+        RenderBand *band = &bands[renderRow];
+        band->coarseY = coarseY;
+        band->fineY = fineYpointer;
+        band->line = renderRow * 8;
+        band->pp = frame + (renderRow * 8 * ppStride);
+        band->ppStride = ppStride;
+
+        if (reusable && !((video.rasterBands | spriteBands | lastSpriteBands) & (1 << renderRow)) && coarseY == lastCoarseY[renderRow] && fineYpointer == lastFineY[renderRow])
+        { // Same place in the nametable and nothing drawn over it, so it's the same pixels unless the rows it reads changed
+            uint32_t rowsRead = 1u << coarseY;
+
+            if (fineYpointer)
+            { // Runs into the next row
+                rowsRead |= 1u << ((coarseY + 1 > video.winYrollover) ? video.winYreset : coarseY + 1);
+            }
+            band->reuse = !(video.rowsChanged & rowsRead);
+        }
         else
         {
-            for (int xChar = 0; xChar < 120; xChar++)
-            { // 15 characters wide
-
-                uint8_t twoBits = temp >> 14; // Smash this down into 2 lowest bits
-                if (*sp == spriteAlphaColor)
-                {                                                           // Transparent sprite pixel? Draw background color...
-                    uint16_t tempShort = paletteRGB[tempPalette | twoBits]; // Add those 2 bits to palette index to get color (0-3)
-                    // uint16_t tempShort = paletteRGB[(*tilePointer >> 8) | twoBits];	//Add those 2 bits to palette index to get color (0-3)
-                    *pointer++ = tempShort; //...twice (fat pixels)
-                    *pointer++ = tempShort;
-                }
-                else
-                {                     // Else draw sprite pixel...
-                    *pointer++ = *sp; //..twice (fat pixels)
-                    *pointer++ = *sp;
+            band->reuse = false;
+        }
+        lastCoarseY[renderRow] = coarseY;
+        lastFineY[renderRow] = fineYpointer;
+        if (band->reuse)
+        {
+            rowsReused += 8;
+        }
+        else
+        {
+            bandsRendered++;
+        }
+
+        if (video.rasterBands & (1 << renderRow))
+        { // A line in this band may jump, so follow it a line at a time like RenderRow will
+            for (int line = renderRow * 8; line < renderRow * 8 + 8; line++)
+            {
+                if (video.raster[line].flags & rasterJumpY)
+                {
+                    coarseY = video.raster[line].jumpRow;
+                    fineYpointer = video.raster[line].jumpFine;
+                    scrollYflag = true; // A jump replaces the window Y scroll for the rest of the screen
                 }
-                sp++;
-                temp <<= 2; // Shift for next 2 bit color pair
-
-                if (++fineXPointer == 8)
-                { // Advance fine scroll count and jump to next char if needed
-                    fineXPointer = 0;
-                    tilePointer++; // Advance tile pointer in memory
-                    if (++winXtemp == 32)
-                    {                      // Rollover edge of tiles X?
-                        tilePointer -= 32; // Roll tile X pointer back 32
+                if (++fineYpointer == 8)
+                {
+                    fineYpointer = 0;
+                    if (++coarseY > video.winYrollover)
+                    {
+                        coarseY = video.winYreset;
                     }
-                    temp = patternTable[((*tilePointer & 0x00FF) << 3) + fineYpointer]; // Fetch next line from pattern table
-                    tempPalette = (*tilePointer & 0x700) >> 6;                          // Palette is lower 3 bits of upper word. Mask and shift 6 to the right to get the palette index 0bxxxPPPbb P = palette pointer b = bits (the 4 colors per palette)
                 }
             }
         }
+        else if (++coarseY > video.winYrollover)
+        { // 8 lines always cross exactly one character edge, and leave the fine pointer where it started
+            coarseY = video.winYreset;
+        }
+    }
+
+    lastSpriteBands = spriteBands;
+
+    recolor = video.paletteChanged && indexedFrame;
+    video.rowsChanged = 0; // Seen now, the next frame compares against this one
+    video.redrawAll = false;
+    video.paletteChanged = false;
 
-        if (++fineYsubCount > 1)
+    if (bandsRendered == 0 && !recolor)
+    { // Nothing to composite and nothing to present
+        framesUnchanged++;
+        return false;
+    }
+
+    if (renderThreadCount > 1)
+    {
+        pthread_mutex_lock(&bandMutex);
+        g_atomic_int_set(&nextBand, 0);
+        bandWorkersDone = 0;
+        bandGeneration++;
+        pthread_cond_broadcast(&bandStart);
+        pthread_mutex_unlock(&bandMutex);
+
+        renderBands(); // Pitch in rather than sit idle
+
+        pthread_mutex_lock(&bandMutex);
+        while (bandWorkersDone < renderThreadCount - 1)
+        {
+            pthread_cond_wait(&bandFinish, &bandMutex);
+        }
+        pthread_mutex_unlock(&bandMutex);
+    }
+    else
+    {
+        g_atomic_int_set(&nextBand, 0);
+        renderBands();
+    }
+
+    if (indexedFrame)
+    {
+        resolveFrame(frame, stride);
+    }
+
+    lastFrame = frame;
+    lastStride = stride;
+    lastIndexed = indexedFrame;
+    return true;
+}
+
+// Keeps the frame before each snapshot so drawPlayfieldBlend can draw in between the two
+void setInterpolation(bool state)
+{
+    interpolation = state;
+}
+
+// Like drawPlayfield, but with row scroll and sprite positions blend / 256 of the way from the frame before the snapshot to it
+// (0 = last frame, 256 = the snapshot itself). Lets a display faster than the logic frame rate show motion smoothly.
+// Tiles, palettes and the HUD are always the snapshot's, only positions are interpolated
+// Scroll position blend / 256 of the way from one frame to the next, or where it ended up if it jumped
+static uint8_t blendScroll(uint8_t from, uint8_t to, int blend)
+{
+    int delta = (int8_t)(to - from); // The nametable is 256 pixels around, so take the short way
+
+    if (delta != 0 && delta >= -INTERPOLATE_MAX && delta <= INTERPOLATE_MAX)
+    {
+        return from + (delta * blend) / 256;
+    }
+    return to;
+}
+
+bool drawPlayfieldBlend(uint32_t *frame, int stride, int blend)
+{
+    uint8_t winXsnapshot[32];
+    uint8_t winXfineSnapshot[32];
+    uint8_t rasterXsnapshot[FRAME_HEIGHT];
+    SpriteEntry *spritesSnapshot = video.sprites;
+    int spriteCountSnapshot = video.spriteCount;
+    int count = 0;
+    bool drawn;
+
+    if (!interpolation || blend >= 256)
+    {
+        return drawPlayfield(frame, stride);
+    }
+    blend = blend < 0 ? 0 : blend;
+
+    memcpy(winXsnapshot, video.winX, sizeof(winXsnapshot));
+    memcpy(winXfineSnapshot, video.winXfine, sizeof(winXfineSnapshot));
+    for (int row = 0; row < 32; row++)
+    {
+        uint8_t x = blendScroll(video.fromX[row], (video.winX[row] << 3) | video.winXfine[row], blend);
+
+        video.winX[row] = x >> 3;
+        video.winXfine[row] = x & 0x07;
+    }
+    for (int line = 0; line < FRAME_HEIGHT; line++)
+    {
+        RasterLine *effect = &video.raster[line];
+
+        rasterXsnapshot[line] = (effect->winX << 3) | effect->winXfine;
+        if (effect->flags & rasterScrollX)
         {
-            fineYsubCount = 0;
-            if (++fineYpointer == 8)
-            {                     // Did we pass a character edge with the fine Y scroll?
-                fineYpointer = 0; // Reset scroll and advance character
-                if (++coarseY > winYrollover)
+            uint8_t x = blendScroll(video.fromRasterX[line], rasterXsnapshot[line], blend);
+
+            effect->winX = x >> 3;
+            effect->winXfine = x & 0x07;
+        }
+    }
+
+    for (int which = 0; which < video.spriteCount; which++)
+    { // Sprites are matched by draw order, so only ones drawn in the same slot as last frame move
+        SpriteEntry *sprite = &blendSprites[count];
+
+        *sprite = video.sprites[which];
+        if (which < video.fromCount)
+        {
+            const SpriteEntry *from = &video.fromSprites[which];
+            int dx = sprite->x - from->x;
+            int dy = sprite->y - from->y;
+
+            if (from->meta == sprite->meta && from->pattern == sprite->pattern && from->flags == sprite->flags && from->palette == sprite->palette &&
+                (dx || dy) && dx >= -INTERPOLATE_MAX && dx <= INTERPOLATE_MAX && dy >= -INTERPOLATE_MAX && dy <= INTERPOLATE_MAX)
+            {
+                int width = sprite->meta >= 0 ? metasprites[sprite->meta].width : 8;
+                int height = sprite->meta >= 0 ? metasprites[sprite->meta].height : 8;
+
+                if (!clipSprite(sprite, from->x + (dx * blend) / 256, from->y + (dy * blend) / 256, width, height, video.xLeft, video.xRight, video.yTop, video.yBottom))
                 {
-                    coarseY = winYreset;
+                    continue;
                 }
             }
         }
+        count++;
     }
+    video.sprites = blendSprites;
+    video.spriteCount = count;
 
-    // gpio_put(27, 0);
+    lastFrame = NULL; // Nothing to reuse, the positions all moved
+    drawn = drawPlayfield(frame, stride);
+    lastFrame = NULL; // and the snapshot itself can't reuse this frame's bands either
+
+    memcpy(video.winX, winXsnapshot, sizeof(winXsnapshot));
+    memcpy(video.winXfine, winXfineSnapshot, sizeof(winXfineSnapshot));
+    for (int line = 0; line < FRAME_HEIGHT; line++)
+    {
+        video.raster[line].winX = rasterXsnapshot[line] >> 3;
+        video.raster[line].winXfine = rasterXsnapshot[line] & 0x07;
+    }
+    video.sprites = spritesSnapshot;
+    video.spriteCount = spriteCountSnapshot;
+    return drawn;
+}
+
+// Display lines reused from the previous frame instead of rendered, and frames skipped because nothing changed, since boot
+void getReuseStats(uint32_t *rows, uint32_t *frames)
+{
+    *rows = rowsReused;
+    *frames = framesUnchanged;
+}
+
+// Renders into an 8-bit indexed frame and looks the colors up for the whole frame in one pass at the end, instead of line by line.
+// The index frame is kept, so a palette change alone can be shown with resolveFrame() without rendering again
+void setIndexedFrame(bool state)
+{
+    indexedFrame = state;
+}
+
+// Colors the last indexed frame with the snapshot palette
+void resolveFrame(uint32_t *frame, int stride)
+{
+    for (int line = 0; line < FRAME_HEIGHT; line++)
+    {
+        resolveLine(frame, indexFrame[line]);
+        frame += stride / sizeof(uint32_t);
+    }
+}
+
+// Renders one band (8 lines) from its own context, so bands don't share any state while they're drawn
+void RenderRow(RenderBand *band)
+{
+    uint8_t bgLine[FRAME_WIDTH + 16]; // Background palette indexes for the current line, 16 tiles wide so fine X scroll is just an offset into it
+    const SpriteEntry *visible[HUD_GROUPS * HUD_GROUP_MAX + SPRITE_MAX]; // HUD then sprites that cross this band, still in draw order
+    int visibleCount = 0;
+    uint8_t coarseY = band->coarseY;
+    uint8_t fineYpointer = band->fineY;
+    int line = band->line;
+    uint32_t *pp = band->pp;
+
+    if (band->reuse)
+    { // Indexed frames keep the last frame's indexes, so there's nothing to do there
+        if (!indexedFrame && lastFrame != band->pp - line * band->ppStride)
+        {
+            for (int yLine = 0; yLine < 8; yLine++)
+            {
+                memcpy(pp, lastFrame + (line + yLine) * band->ppStride, FRAME_WIDTH * sizeof(uint32_t));
+                pp += band->ppStride;
+            }
+        }
+        return;
+    }
+    const RasterLine *raster = (video.rasterBands & (1 << (line >> 3))) ? &video.raster[line] : NULL; // Per line overrides, if any line of this band has one
+    bool aligned = raster == NULL && fineYpointer == 0 && video.winXfine[coarseY] == 0; // Band lines up with a nametable row (menus, title, jail, story screens)
+    const uint8_t *tileLines[15]; // Aligned bands read the same 15 tiles for all 8 lines, so look them up once
+    uint64_t tilePalettes[15];
+
+    // gpio_put(27, 1);
+
+    if (aligned)
+    {
+        for (int xChar = 0; xChar < 15; xChar++)
+        {
+            uint16_t tile = video.nameTable[coarseY][(video.winX[coarseY] + xChar) & 31]; // Same rollover at the edge of the tilemap
+
+            tileLines[xChar] = video.patternPixels[0][(tile & 0x00FF) << 3];
+            tilePalettes[xChar] = ((tile & 0x700) >> 6) * 0x0101010101010101ULL;
+        }
+    }
+
+    for (int which = 0; which < video.hudCount; which++)
+    { // HUD first so it wins over every sprite
+        if (video.hud[which].top < line + 8 && video.hud[which].bottom > line)
+        {
+            visible[visibleCount++] = &video.hud[which];
+        }
+    }
+
+    for (int which = 0; which < video.spriteCount; which++)
+    { // Cull once per band so each line only looks at sprites that can touch it
+        if (video.sprites[which].top < line + 8 && video.sprites[which].bottom > line)
+        {
+            visible[visibleCount++] = &video.sprites[which];
+        }
+    }
+
+    for (int yLine = 0; yLine < 8; yLine++)
+    { // Each char line is 8 pixels at native resolution, the 2x expansion happens when the frame is presented
+
+        uint8_t *indexes; // This line as paletteRGB indexes, sprites get drawn into it before colors are looked up
+
+        if (aligned)
+        { // Whole 8 pixel tile spans, no fine scroll offset or edge checks
+            for (int xChar = 0; xChar < 15; xChar++)
+            {
+                uint64_t pixels;
+
+                memcpy(&pixels, tileLines[xChar] + (yLine << 3), 8);
+                pixels |= tilePalettes[xChar];
+                memcpy(&bgLine[xChar << 3], &pixels, 8);
+            }
+            indexes = bgLine;
+        }
+        else if (raster)
+        {
+            const RasterLine *effect = &raster[yLine];
+            uint8_t tileX;
+            uint8_t fineX;
+
+            if (effect->flags & rasterJumpY)
+            {
+                coarseY = effect->jumpRow;
+                fineYpointer = effect->jumpFine;
+            }
+            tileX = video.winX[coarseY];
+            fineX = video.winXfine[coarseY];
+            if (effect->flags & rasterScrollX)
+            {
+                tileX = effect->winX;
+                fineX = effect->winXfine;
+            }
+            expandPatternLine(bgLine, coarseY, fineYpointer, tileX);
+            if (effect->flags & rasterPalette)
+            {
+                uint64_t bank = effect->paletteBank * 0x0101010101010101ULL;
 
-    // Row drawn, now wait for DMA to open up
+                for (int x = 0; x < FRAME_WIDTH + 16; x += 8)
+                { // Before sprites go in, so only the background changes
+                    uint64_t pixels;
+
+                    memcpy(&pixels, &bgLine[x], 8);
+                    pixels ^= bank;
+                    memcpy(&bgLine[x], &pixels, 8);
+                }
+            }
+            indexes = &bgLine[fineX];
+        }
+        else
+        {
+            expandPatternLine(bgLine, coarseY, fineYpointer, video.winX[coarseY]);
+            indexes = &bgLine[video.winXfine[coarseY]]; // Fine X scroll is just where we start reading the expanded line
+        }
+        if (visibleCount)
+        {
+            drawSpriteLine(indexes, line, visible, visibleCount);
+        }
+        if (indexedFrame)
+        { // Colors get resolved for the whole frame at the end
+            memcpy(indexFrame[line], indexes, FRAME_WIDTH);
+        }
+        else
+        {
+            resolveLine(pp, indexes);
+        }
+        line++;
+        pp += band->ppStride;
+
+        if (++fineYpointer == 8)
+        {                     // Did we pass a character edge with the fine Y scroll?
+            fineYpointer = 0; // Reset scroll and advance character
+            if (++coarseY > video.winYrollover)
+            {
+                coarseY = video.winYreset;
+            }
+        }
+    }
+
+    // gpio_put(27, 0);
 }
 
 void LCDsetDrawFlag()
@@ -1221,6 +2297,7 @@ void LCDsetDrawFlag()
 // Plays a 11025Hz 8-bit mono WAVE file from file system using the PWM function and DMA on GPIO14 (gamebadge channel 4)
 void playAudio(const char *path, int newPriority)
 {
+    traceBegin("playAudio", path);
 
     if (audioPlaying == true)
     { // Only one sound at a time
@@ -1230,6 +2307,7 @@ void playAudio(const char *path, int newPriority)
         }
         else
         {
+            traceEnd();
             return;
         }
     }
@@ -1239,10 +2317,12 @@ void playAudio(const char *path, int newPriority)
     {
         printf("Failed to load sound file. %s\n", path);
         audioPlaying = false;
+        traceEnd();
         return;
     }
     audioPlaying = true;
     ma_sound_start(&sound);
+    traceEnd();
 }
 
 void stopAudio()
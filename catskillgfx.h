@@ -6,11 +6,11 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-#define ROWS 240
-#define COLS 240
-#define BYTES_PER_PIXEL 3
-
-extern uint8_t playfield[ROWS * COLS * BYTES_PER_PIXEL];
+#define FRAME_WIDTH 120  // Native resolution the renderer works at (15x15 tiles)
+#define FRAME_HEIGHT 120
+#define FRAME_SCALE 2    // Fat pixel expansion, applied once when the frame is presented
+#define ROWS (FRAME_HEIGHT * FRAME_SCALE)
+#define COLS (FRAME_WIDTH * FRAME_SCALE)
 
 void initGfx();
 void setButton(uint16_t, bool);
@@ -20,6 +20,12 @@ bool button(uint8_t which);
 void serviceDebounce();
 bool loadRGB(const char *path);
 void loadPalette(const char *path);
+void paletteFadeOut(int frames);
+void paletteFadeIn(int frames);
+void paletteCrossfade(const char *path, int frames);
+bool paletteFadingOut();
+bool paletteFading();
+void buildFadeTable();
 void loadPattern(const char *path, uint16_t start, uint16_t length);
 
 void setWinYjump(int jumpFrom, int nextRow);
@@ -29,17 +35,51 @@ void setSpriteWindow(uint8_t x0, uint8_t x1, uint8_t y0, uint8_t y1);
 void setWindow(uint8_t x, uint8_t y);
 void setWindowSlice(int whichRow, uint8_t x);
 void setCoarseYRollover(int topRow, int bottomRow);
+void setRasterScrollX(int line, uint8_t x);
+void setRasterScrollXRange(int first, int last, uint8_t x);
+void setRasterJumpY(int line, uint8_t y);
+void setRasterPalette(int line, uint8_t bank);
+void clearRaster();
 
 // NEW 3-27-23
-void pauseLCD(bool state);
 bool getRenderStatus();
-void RenderRow();
+
+#define RENDER_MAX_THREADS 8
+
+typedef struct
+{                    // Everything needed to render one 8 line band of the display
+    uint8_t coarseY; // Nametable row and pattern line the band starts on
+    uint8_t fineY;
+    uint8_t line;    // First display line of the band
+    uint32_t *pp;    // First output line of the band
+    int ppStride;    // Distance between output lines, in pixels
+    bool reuse;      // Nothing in the band changed, copy it from the last frame
+} RenderBand;
+
+void RenderRow(RenderBand *band);
+void setRenderThreads(int count);
+int getRenderThreads();
+
+enum renderKernels
+{
+    kernelScalar,
+    kernelAVX2
+};
+extern int renderKernel;
+void setRenderKernel(int whichKernel);
 void LCDsetDrawFlag();
+bool LCDgetDrawFlag();
+void snapshotVideo();
+void skipFrame();
 
 //bool isDMAbusy(int whatChannel);
 
-void drawLineOfPlayfield(const uint16_t *data, int whatSize);
-void drawPlayfield();
+bool drawPlayfield(uint32_t *frame, int stride);
+void setInterpolation(bool state);
+bool drawPlayfieldBlend(uint32_t *frame, int stride, int blend);
+void getReuseStats(uint32_t *rows, uint32_t *frames);
+void setIndexedFrame(bool state);
+void resolveFrame(uint32_t *frame, int stride);
 
 void drawTile(int xPos, int yPos, uint16_t whatTile, char whatPalette, int flags);
 void drawTileXY(int xPos, int yPos, uint16_t tileX, uint16_t tileY, char whatPalette, int flags);
@@ -61,9 +101,16 @@ void drawSpriteDecimalRight(int32_t theValue, uint8_t xRight, uint8_t y, int wha
 
 void drawSpriteTile(int xPos, int yPos, uint16_t whichTile, uint8_t whichPalette, bool hFlip, bool vFlip);
 void drawSpriteRange(int xPos, int yPos, uint16_t tileX, uint16_t tileY, uint16_t xWide, uint16_t yHigh, uint8_t whichPalette, bool hFlip, bool vFlip);
+void getMetaspriteStats(uint32_t *hits, uint32_t *misses);
 void drawSpriteSingle(int xPos, int yPos, uint16_t tileX, uint16_t tileY, uint8_t whichPalette, bool hFlip, bool vFlip);
 
 void clearSprite();
+
+#define HUD_GROUPS 4 // Retained HUD overlay groups, see hudBegin()
+void hudBegin(int group);
+void hudEnd();
+void hudShow(int group);
+
 void updatePalette(int position, int theIndex);
 void updatePaletteRGB(int position, char r, char g, char b);
 void convertBitplanePattern(uint16_t position, unsigned char *lowBitP, unsigned char *highBitP);
@@ -1,4 +1,5 @@
 #include "catskillmusic.h"
+#include "catskilltrace.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -121,10 +122,18 @@ void musicResume()
     }
 }
 
+// Non-zero while a track is playing. It has to be serviced every tick then, or the buffer runs dry
+int musicActive()
+{
+    return musicState == musicPlaying;
+}
+
 void musicPlay(const char *path, int track)
 {
+    traceBegin("musicPlay", path);
     if (musicState == musicNotReady)
     {
+        traceEnd();
         return;
     }
     gme_open_file(path, &emu, MUSIC_SAMPLERATE);
@@ -132,6 +141,7 @@ void musicPlay(const char *path, int track)
     musicState = musicPlaying;
     musicGetFrame();
     musicPlayFrame();
+    traceEnd();
 }
 
 void serviceMusic()
@@ -12,5 +12,6 @@ void musicPause();
 void musicResume();
 void musicPlay(const char *path, int track);
 int musicTrack();
+int musicActive();
 void serviceMusic();
 #endif
\ No newline at end of file
@@ -0,0 +1,185 @@
+// Frame timing stats, see catskillstats.h
+#define _POSIX_C_SOURCE 200112L // clock_gettime
+#include "catskillstats.h"
+#include "catskillgame.h"
+#include "catskilltrace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define STAT_BUCKETS 128 // 4 per power of 2 up to 2^32 ns (4 seconds), anything longer lands in the last one
+
+typedef struct
+{
+    uint32_t count;
+    uint64_t max;
+    uint32_t buckets[STAT_BUCKETS];
+} StatHistogram;
+
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER; // Guards the histograms, timers are recorded from several threads
+static StatHistogram timers[STAT_TIMERS];
+static StatHistogram frameStates[STAT_STATES];
+static uint64_t timerStart[STAT_TIMERS]; // When statsBegin was called, only touched by the thread running that timer
+static int frameState; // Game state the current gameFrame started in
+
+static const char *timerNames[STAT_TIMERS] = {
+    "gameLoopLogic",
+    "gameFrame",
+    "objectLogic",
+    "budLogic2",
+    "serviceAudio",
+    "serviceMusic",
+    "drawPlayfield",
+    "render worker",
+    "GTK present",
+    "tick late",
+    "snapshot wait"};
+
+// Monotonic time in nanoseconds
+uint64_t statsNow()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int bucketOf(uint64_t nanoseconds)
+{
+    int power = 0;
+    int bucket;
+
+    if (nanoseconds < 4)
+    {
+        return (int)nanoseconds;
+    }
+    while ((nanoseconds >> power) > 7)
+    { // Find the top 3 bits
+        power++;
+    }
+    bucket = (power + 1) * 4 + (int)((nanoseconds >> power) & 3); // 4-7 << power, split in 4
+    return bucket < STAT_BUCKETS ? bucket : STAT_BUCKETS - 1;
+}
+
+// Largest time that lands in a bucket
+static uint64_t bucketTop(int bucket)
+{
+    if (bucket < 4)
+    {
+        return bucket;
+    }
+    return ((uint64_t)(4 + (bucket & 3) + 1) << (bucket / 4 - 1)) - 1;
+}
+
+static void record(StatHistogram *histogram, uint64_t nanoseconds)
+{
+    histogram->count++;
+    histogram->buckets[bucketOf(nanoseconds)]++;
+    if (nanoseconds > histogram->max)
+    {
+        histogram->max = nanoseconds;
+    }
+}
+
+// Timers also show up as slices when tracing
+void statsBegin(int which)
+{
+    traceBegin(timerNames[which], NULL);
+    timerStart[which] = statsNow();
+}
+
+void statsEnd(int which)
+{
+    uint64_t time = statsNow() - timerStart[which];
+
+    pthread_mutex_lock(&statsLock);
+    record(&timers[which], time);
+    pthread_mutex_unlock(&statsLock);
+    traceEnd();
+}
+
+// Starts the statGameFrame timer, which is also counted for the game state it was started in
+void statsBeginFrame(int state)
+{
+    frameState = state;
+    traceBegin(gameStateName(state), NULL); // Named after the state so slow states stand out in a trace
+    timerStart[statGameFrame] = statsNow();
+}
+
+void statsEndFrame()
+{
+    uint64_t time = statsNow() - timerStart[statGameFrame];
+
+    pthread_mutex_lock(&statsLock);
+    record(&timers[statGameFrame], time);
+    if (frameState >= 0 && frameState < STAT_STATES)
+    {
+        record(&frameStates[frameState], time);
+    }
+    pthread_mutex_unlock(&statsLock);
+    traceEnd();
+}
+
+// Adds a time measured some other way
+void statsRecord(int which, uint64_t nanoseconds)
+{
+    pthread_mutex_lock(&statsLock);
+    record(&timers[which], nanoseconds);
+    pthread_mutex_unlock(&statsLock);
+}
+
+// Time the slowest (100 - percent)% took at least, as the top of its bucket
+static double percentile(const StatHistogram *histogram, int percent)
+{
+    uint64_t wanted = ((uint64_t)histogram->count * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    for (int bucket = 0; bucket < STAT_BUCKETS; bucket++)
+    {
+        seen += histogram->buckets[bucket];
+        if (seen >= wanted)
+        {
+            uint64_t top = bucketTop(bucket);
+            return (top < histogram->max ? top : histogram->max) / 1000.0;
+        }
+    }
+    return histogram->max / 1000.0;
+}
+
+static void printHistogram(const char *name, const StatHistogram *histogram)
+{
+    if (histogram->count == 0)
+    {
+        return;
+    }
+    printf("%-24s %8u %9.1f %9.1f %9.1f %9.1f\n", name, histogram->count, percentile(histogram, 50), percentile(histogram, 95), percentile(histogram, 99), histogram->max / 1000.0);
+}
+
+// Prints every timer that has run, from a copy taken all at once so the numbers agree with each other
+void statsPrint()
+{
+    static StatHistogram timersCopy[STAT_TIMERS]; // Off the stack. Only one thread prints at a time (logic on F3, main on exit once logic has stopped)
+    static StatHistogram frameStatesCopy[STAT_STATES];
+    char name[32];
+
+    pthread_mutex_lock(&statsLock);
+    memcpy(timersCopy, timers, sizeof(timersCopy));
+    memcpy(frameStatesCopy, frameStates, sizeof(frameStatesCopy));
+    pthread_mutex_unlock(&statsLock);
+
+    printf("%-24s %8s %9s %9s %9s %9s\n", "timing (us)", "count", "p50", "p95", "p99", "max");
+    for (int which = 0; which < STAT_TIMERS; which++)
+    {
+        printHistogram(timerNames[which], &timersCopy[which]);
+        if (which == statGameFrame)
+        {
+            for (int state = 0; state < STAT_STATES; state++)
+            {
+                snprintf(name, sizeof(name), "  %s", gameStateName(state));
+                printHistogram(name, &frameStatesCopy[state]);
+            }
+        }
+    }
+    fflush(stdout);
+}
@@ -0,0 +1,32 @@
+#ifndef _CATSKILLSTATS_H
+#define _CATSKILLSTATS_H
+#include <stdint.h>
+
+// Frame timing stats. Each timer keeps a histogram of how long it took, in fixed log scale buckets (4 per power of 2, so about
+// 25% resolution) which is enough for percentiles without storing samples. A timer must only be started and stopped by one thread
+enum statTimers
+{
+    statGameLogic,     // gameLoopLogic, every tick
+    statGameFrame,     // gameFrame, also kept per game state
+    statObjectLogic,
+    statBudLogic,
+    statServiceAudio,
+    statServiceMusic,
+    statDrawPlayfield, // Compositing, on the render worker
+    statRenderWorker,  // The worker's whole turn, including handing the frame to the mailbox
+    statPresent,       // GTK draw callback
+    statTickLate,      // How far past its deadline each tick started (the scheduler's jitter)
+    statSnapshotWait,  // Logic waiting for the worker to let go of the snapshot, only counted when it had to
+    STAT_TIMERS
+};
+
+#define STAT_STATES 16 // Game states with their own gameFrame histogram
+
+uint64_t statsNow();
+void statsBegin(int which);
+void statsEnd(int which);
+void statsBeginFrame(int state);
+void statsEndFrame();
+void statsRecord(int which, uint64_t nanoseconds);
+void statsPrint();
+#endif
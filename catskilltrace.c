@@ -0,0 +1,206 @@
+// Event tracing, see catskilltrace.h
+#include "catskilltrace.h"
+#include "catskillstats.h"
+#include <gtk/gtk.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_THREADS 8      // Threads that can record events
+#define TRACE_EVENTS 0x40000 // Per thread (a few minutes of play), must be a power of 2. Once full the oldest events are overwritten
+#define TRACE_DETAIL 32      // Longest file name kept with an event
+
+typedef struct
+{
+    uint64_t time;
+    const char *name; // NULL for an end event. Must be a string that outlives the trace, like a literal
+    char detail[TRACE_DETAIL];
+} TraceEvent;
+
+typedef struct
+{
+    const char *name;
+    uint32_t count; // Events ever recorded, only written by the owning thread
+    TraceEvent *events;
+} TraceRing;
+
+bool tracing = false; // Set once before the other threads start, read only after that
+
+static TraceRing rings[TRACE_THREADS];
+static volatile gint ringsUsed = 0;
+static pthread_key_t ringKey;
+static uint64_t traceStartTime;
+
+void traceStart()
+{
+    pthread_key_create(&ringKey, NULL);
+    traceStartTime = statsNow();
+    tracing = true;
+}
+
+// The calling thread's ring, handed out the first time it records something. NULL if every ring is taken
+static TraceRing *threadRing()
+{
+    TraceRing *ring = pthread_getspecific(ringKey);
+    int which;
+
+    if (ring)
+    {
+        return ring;
+    }
+    which = g_atomic_int_add(&ringsUsed, 1);
+    if (which >= TRACE_THREADS)
+    {
+        return NULL;
+    }
+    ring = &rings[which];
+    ring->events = malloc(TRACE_EVENTS * sizeof(TraceEvent));
+    if (ring->events == NULL)
+    {
+        return NULL;
+    }
+    pthread_setspecific(ringKey, ring);
+    return ring;
+}
+
+// Names the calling thread in the trace
+void traceThread(const char *name)
+{
+    TraceRing *ring;
+
+    if (!tracing || (ring = threadRing()) == NULL)
+    {
+        return;
+    }
+    ring->name = name;
+}
+
+static void record(const char *name, const char *detail)
+{
+    TraceRing *ring = threadRing();
+    TraceEvent *event;
+
+    if (ring == NULL)
+    {
+        return;
+    }
+    event = &ring->events[ring->count & (TRACE_EVENTS - 1)];
+    event->time = statsNow();
+    event->name = name;
+    event->detail[0] = 0;
+    if (detail)
+    {
+        strncat(event->detail, detail, TRACE_DETAIL - 1);
+    }
+    ring->count++;
+}
+
+// Starts a slice on the calling thread's timeline. detail (a file name, say) is copied and shown with it
+void traceBegin(const char *name, const char *detail)
+{
+    if (tracing)
+    {
+        record(name, detail);
+    }
+}
+
+// Ends the last slice started on this thread
+void traceEnd()
+{
+    if (tracing)
+    {
+        record(NULL, NULL);
+    }
+}
+
+static void writeString(FILE *file, const char *text)
+{
+    fputc('"', file);
+    for (; *text; text++)
+    {
+        if (*text == '"' || *text == '\\')
+        {
+            fputc('\\', file);
+        }
+        fputc((unsigned char)*text >= ' ' ? *text : '?', file);
+    }
+    fputc('"', file);
+}
+
+// Writes every ring to a Chrome trace JSON file. Only call once the other threads that record events have stopped
+bool traceWrite(const char *path)
+{
+    FILE *file;
+    int used = g_atomic_int_get(&ringsUsed);
+    bool first = true;
+    uint32_t written = 0;
+    uint32_t lost = 0;
+
+    if (!tracing)
+    {
+        return false;
+    }
+    file = fopen(path, "w");
+    if (!file)
+    {
+        printf("Unable to write trace file %s\n", path);
+        return false;
+    }
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+    for (int thread = 0; thread < used && thread < TRACE_THREADS; thread++)
+    {
+        TraceRing *ring = &rings[thread];
+        uint32_t start = ring->count > TRACE_EVENTS ? ring->count - TRACE_EVENTS : 0;
+        int depth = 0;
+
+        if (ring->events == NULL)
+        {
+            continue;
+        }
+        lost += start;
+        if (ring->name)
+        {
+            fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", first ? "" : ",", thread + 1);
+            writeString(file, ring->name);
+            fputs("}}", file);
+            first = false;
+        }
+        for (uint32_t index = start; index != ring->count; index++)
+        {
+            TraceEvent *event = &ring->events[index & (TRACE_EVENTS - 1)];
+            double time = (event->time - traceStartTime) / 1000.0; // Microseconds
+
+            if (event->name == NULL)
+            {
+                if (depth == 0)
+                { // Its begin was overwritten
+                    continue;
+                }
+                depth--;
+                fprintf(file, "%s\n{\"ph\":\"E\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}", first ? "" : ",", thread + 1, time);
+            }
+            else
+            {
+                depth++;
+                fprintf(file, "%s\n{\"name\":", first ? "" : ",");
+                writeString(file, event->name);
+                fprintf(file, ",\"ph\":\"B\",\"pid\":1,\"tid\":%d,\"ts\":%.3f", thread + 1, time);
+                if (event->detail[0])
+                {
+                    fputs(",\"args\":{\"detail\":", file);
+                    writeString(file, event->detail);
+                    fputc('}', file);
+                }
+                fputc('}', file);
+            }
+            first = false;
+            written++;
+        }
+    }
+    fputs("\n]}\n", file);
+    fclose(file);
+    printf("trace written to %s, %u events (%u overwritten)\n", path, written, lost);
+    return true;
+}
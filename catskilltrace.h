@@ -0,0 +1,14 @@
+#ifndef _CATSKILLTRACE_H
+#define _CATSKILLTRACE_H
+#include <stdbool.h>
+
+// Opt-in event tracing (--trace). Begin and end events go into a ring buffer owned by the thread recording them, so recording
+// never locks or waits on another thread. traceWrite saves them as Chrome trace event JSON, which opens in Perfetto or about:tracing
+extern bool tracing;
+
+void traceStart();
+void traceThread(const char *name);
+void traceBegin(const char *name, const char *detail);
+void traceEnd();
+bool traceWrite(const char *path);
+#endif
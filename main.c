@@ -1,81 +1,542 @@
+#define _POSIX_C_SOURCE 200112L // clock_nanosleep
 #include <gtk/gtk.h>
 #include <pthread.h>
 #include "catskillgfx.h"
 #include "catskillgame.h"
+#include "catskillstats.h"
+#include "catskilltrace.h"
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <errno.h>
 
-// higher the number the faster the framerate
+// Normal game speed. The speed argument scales the simulation rate by speed / SPEED, so 240 runs the game twice as fast
 #define SPEED 120
+#define LOGIC_RATE 125   // Logic ticks per second at normal speed (the old 8ms timer). gameFrame runs every 3rd tick
+#define MAX_CATCHUP 8    // Ticks run back to back after a stall. Anything past that is dropped and the clock starts over
+#define MAX_FRAMESKIP 4  // Frames skipped in a row while catching up before one gets rendered anyway
+#define IDLE_MAX_MS 1000 // Longest the logic thread sleeps when the game is idle (paused, waiting on a timer) and no key is pressed
+#define QUIET_REFRESHES 10 // Display refreshes with nothing new before the presenter stops asking for them
+#define INPUT_QUEUE 32     // Key events the GTK thread can hold for the logic thread between two ticks
+#define TRACE_FILE "catskill-trace.json" // Written on exit with --trace
+
+// Triple buffered frame mailbox. The worker owns back, the draw callback owns front, and the latest finished frame sits in
+// the mailbox. Each side swaps with the mailbox atomically, so neither ever waits on the other
+#define FRAME_BUFFERS 3
+#define MAILBOX_FRESH 0x04 // Set in the mailbox when it holds a frame the draw callback hasn't picked up yet
 
 static pthread_t drawing_thread;
-static pthread_mutex_t mutex;
-static cairo_surface_t *surface = NULL;
-static int currently_drawing = 0;
-static gboolean drawing_area_configure_cb(GtkWidget *, GdkEventConfigure *);
+static pthread_t logic_thread;
+static volatile gint logic_quit = 0;
+typedef struct
+{
+    uint16_t key;
+    bool down;
+} KeyEvent;
+
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards input_pending, the key queue and stats_requested
+static pthread_cond_t idle_wake;                                // Signalled on a key event or shutdown, with a monotonic clock
+static int input_pending = 0;
+static KeyEvent input_queue[INPUT_QUEUE]; // Key events from the GTK thread, handed to logic at the start of its next tick
+static int input_count = 0;
+static bool stats_requested = false; // F3, printed by the logic thread at the start of its next tick
+static double idle_seconds = 0; // Time the logic thread spent in idle sleeps
+static volatile gint ticking = 1; // The frame clock tick callback is installed
+static pthread_mutex_t worker_mutex; // Guards frame_requested and worker_quit
+static pthread_cond_t worker_wake;   // Signalled when a frame is handed to the worker, or on shutdown
+static pthread_cond_t worker_done;   // Signalled whenever the video snapshot is let go
+static int frame_requested = 0;
+static int render_blend = 256;       // How far between the last two logic frames the worker draws, see drawPlayfieldBlend
+static int worker_quit = 0;
+static cairo_surface_t *surfaces[FRAME_BUFFERS]; // Native resolution frames, the renderer draws straight into their pixels
+static int back_buffer = 2;                      // Only touched by the worker
+static int front_buffer = 0;                     // Only touched by the draw callback
+static volatile gint mailbox = 1;                // Buffer index | MAILBOX_FRESH
+static volatile gint currently_drawing = 0;      // Owns the video snapshot. Taken to snapshot or hand a frame off, let go once it's rendered
+static volatile gint frames_produced = 0;
+static volatile gint frames_presented = 0;
+static volatile gint frames_dropped = 0; // Rendered, then replaced in the mailbox before the draw callback got to it
+static gint64 start_time;                // For the per second stats printed on exit
+static bool interpolate = false;         // --interpolate, draw in between logic frames at the display's refresh rate
+static bool indexed = false;             // --indexed, render palette indexes and color the whole frame at the end
+// When logic took the last two snapshots (only with interpolate). Published with the snapshot: logic writes them while it
+// holds currently_drawing, and the presenter only reads them after taking currently_drawing with a compare and exchange
+static gint64 snapshot_time = 0;
+static gint64 previous_snapshot_time = 0;
+static volatile gint snapshot_serial = 0;
+static int rendered_serial = -1; // What the presenter last asked for, so a refresh with nothing new renders nothing
+static int rendered_blend = -1;
+static int frames_skipped = 0;           // Not rendered because logic was catching up
+static int ticks_dropped = 0;            // Given up on after a stall longer than MAX_CATCHUP ticks
+static volatile gint refreshes_busy = 0; // In between frames not rendered because logic had the snapshot
+static bool print_stats = false;         // --stats, print the frame timings on exit
 static void drawing_area_draw_cb(GtkWidget *, cairo_t *, void *);
 static void *thread_draw(void *);
+static void *thread_logic(void *);
 static int speed = SPEED;
+static GtkWidget *drawing_area;
+
+// Ends an idle sleep early, used to stop the logic thread
+static void wake_logic()
+{
+    pthread_mutex_lock(&idle_mutex);
+    input_pending = 1;
+    pthread_cond_signal(&idle_wake);
+    pthread_mutex_unlock(&idle_mutex);
+}
+
+// Queues a key event for the logic thread, which owns the button state
+static void queue_key(uint16_t key, bool down)
+{
+    int which;
+
+    pthread_mutex_lock(&idle_mutex);
+    which = input_count;
+    if (which < INPUT_QUEUE)
+    {
+        input_count++;
+    }
+    else
+    { // Full. Fold it into the key's last queued event so the key still ends up in the right state. Failing that, a release
+      // takes the place of the oldest press: a lost press only misses a key, a lost release would leave it held
+        for (which = INPUT_QUEUE - 1; which >= 0 && input_queue[which].key != key; which--)
+        {
+        }
+        for (int press = 0; which < 0 && !down && press < INPUT_QUEUE; press++)
+        {
+            if (input_queue[press].down)
+            {
+                which = press;
+            }
+        }
+    }
+    if (which >= 0)
+    {
+        input_queue[which].key = key;
+        input_queue[which].down = down;
+    }
+    input_pending = 1;
+    pthread_cond_signal(&idle_wake);
+    pthread_mutex_unlock(&idle_mutex);
+}
 
 gboolean keypress_function(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
     uint16_t k = event->keyval;
-    setButton(k, true);
+    queue_key(k, true);
     return TRUE;
 }
 
+// Frame timings so far, see catskillstats.h
+static void print_timing()
+{
+    statsPrint();
+    printf("in between frames skipped while logic had the snapshot %d\n", g_atomic_int_get(&refreshes_busy));
+}
+
 gboolean keyrelease_function(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
     uint16_t k = event->keyval;
-    setButton(k, false);
+    if (k == GDK_KEY_F3)
+    { // On release so holding it down doesn't repeat
+        pthread_mutex_lock(&idle_mutex);
+        stats_requested = true;
+        pthread_mutex_unlock(&idle_mutex);
+    }
+    queue_key(k, false);
     return TRUE;
 }
 
+// Takes the key events queued since the last tick and applies them, in order, on the logic thread. Stats asked for with F3
+// are printed here too, between ticks
+static void take_input()
+{
+    KeyEvent keys[INPUT_QUEUE];
+    int count;
+    bool print;
+
+    pthread_mutex_lock(&idle_mutex);
+    count = input_count;
+    memcpy(keys, input_queue, count * sizeof(KeyEvent));
+    input_count = 0;
+    input_pending = 0; // All seen, the next idle sleep waits for a new one
+    print = stats_requested;
+    stats_requested = false;
+    pthread_mutex_unlock(&idle_mutex);
+
+    for (int which = 0; which < count; which++)
+    {
+        setButton(keys[which].key, keys[which].down);
+    }
+    if (print)
+    {
+        print_timing();
+    }
+}
+
+// Puts a buffer in the mailbox and returns what was there
+static gint mailbox_swap(gint value)
+{
+    gint old;
+    do
+    {
+        old = g_atomic_int_get(&mailbox);
+    } while (!g_atomic_int_compare_and_exchange(&mailbox, old, value));
+    return old;
+}
+
+// Wakes the render worker with the quit flag set and waits for it to finish the frame it's on, then stops the band render
+// threads it was using. Safe to call more than once
+static void stop_render_worker()
+{
+    pthread_mutex_lock(&worker_mutex);
+    if (worker_quit)
+    {
+        pthread_mutex_unlock(&worker_mutex);
+        return;
+    }
+    worker_quit = 1;
+    pthread_cond_signal(&worker_wake);
+    pthread_mutex_unlock(&worker_mutex);
+    pthread_join(drawing_thread, NULL);
+    setRenderThreads(1); // Signals and joins the band pool, nothing renders after this
+    printf("frames produced %d, presented %d, dropped %d\n", g_atomic_int_get(&frames_produced), g_atomic_int_get(&frames_presented), g_atomic_int_get(&frames_dropped));
+
+    uint32_t rows_reused, frames_unchanged;
+    double seconds = (g_get_monotonic_time() - start_time) / 1000000.0;
+    getReuseStats(&rows_reused, &frames_unchanged);
+    printf("rows reused %u (%.0f per second), unchanged frames skipped %u\n", rows_reused, seconds > 0 ? rows_reused / seconds : 0, frames_unchanged);
+}
+
+// Stops the logic thread after the tick it's on, so nothing is drawn or loaded once it returns. Safe to call more than once
+static void stop_logic_thread()
+{
+    if (g_atomic_int_get(&logic_quit))
+    {
+        return;
+    }
+    g_atomic_int_set(&logic_quit, 1);
+    wake_logic();
+    pthread_join(logic_thread, NULL);
+    printf("frames skipped catching up %d, ticks dropped %d\n", frames_skipped, ticks_dropped);
+
+    struct timespec cpu;
+    double seconds = (g_get_monotonic_time() - start_time) / 1000000.0;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    printf("cpu %.1f%% over %.0f seconds, %.0f seconds idle\n", seconds > 0 ? (cpu.tv_sec + cpu.tv_nsec / 1e9) * 100 / seconds : 0, seconds, idle_seconds);
+}
+
 void close_game(GtkWidget *window, gpointer data)
 {
+    stop_logic_thread();
+    stop_render_worker(); // Before the game tears down what the worker renders from
     quitGame();
     gtk_main_quit();
 }
 
-gboolean timer_exe(GtkWidget *window)
+static gboolean frame_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer data);
+
+static gboolean start_ticking(gpointer data)
+{
+    gtk_widget_add_tick_callback(drawing_area, frame_tick, NULL, NULL);
+    return FALSE;
+}
+
+// Called from the worker and logic threads when there's something new to show. The presenter lets the frame clock stop
+// while nothing changes, so a paused game doesn't wake up for every display refresh
+static void wake_presenter()
+{
+    if (g_atomic_int_compare_and_exchange(&ticking, 0, 1))
+    { // GTK can only be touched from its own thread
+        g_idle_add(start_ticking, NULL);
+    }
+}
+
+// Something for the presenter to do this refresh, a frame to show or an in between frame to ask for
+static bool presenter_busy()
+{
+    return (g_atomic_int_get(&mailbox) & MAILBOX_FRESH) || (interpolate && (g_atomic_int_get(&snapshot_serial) != rendered_serial || rendered_blend != 256));
+}
+
+// Takes the video snapshot, waiting for the worker if it's still rendering from it
+static void acquire_snapshot()
 {
-    static gboolean first_execution = TRUE;
-    int drawing_status = g_atomic_int_get(&currently_drawing);
-    if (drawing_status == 0)
+    uint64_t wait_start = 0;
+
+    pthread_mutex_lock(&worker_mutex);
+    while (!g_atomic_int_compare_and_exchange(&currently_drawing, 0, 1))
+    { // Only waits if a render takes longer than a whole logic frame
+        if (!wait_start)
+        {
+            wait_start = statsNow();
+            traceBegin("snapshot wait", NULL);
+        }
+        pthread_cond_wait(&worker_done, &worker_mutex);
+    }
+    pthread_mutex_unlock(&worker_mutex);
+    if (wait_start)
     {
-        gameLoop();
-        static pthread_t thread_info;
-        if (first_execution != TRUE)
+        statsRecord(statSnapshotWait, statsNow() - wait_start);
+        traceEnd();
+    }
+}
+
+static void release_snapshot()
+{
+    pthread_mutex_lock(&worker_mutex);
+    g_atomic_int_set(&currently_drawing, 0);
+    pthread_cond_broadcast(&worker_done);
+    pthread_mutex_unlock(&worker_mutex);
+}
+
+// Hands the snapshot to the render worker, which releases it once it's drawn. The caller must already own currently_drawing
+// (acquire_snapshot, or the presenter's compare and exchange), so the flag is set before the worker is woken and a tick can't
+// take the snapshot for a second draw in between
+static void request_render(int blend)
+{
+    pthread_mutex_lock(&worker_mutex);
+    render_blend = blend;
+    frame_requested = 1;
+    pthread_cond_signal(&worker_wake);
+    pthread_mutex_unlock(&worker_mutex);
+}
+
+// One logic tick. behind means more ticks are already due, so a finished frame can be skipped instead of rendered. Without
+// input the tick runs on the buttons as they were, leaving queued key events for a later tick
+static void logic_tick(bool behind, bool input)
+{
+    static int skipped_in_row = 0;
+
+    if (input)
+    {
+        take_input();
+    }
+    gameLoop(); // Runs while the worker renders the previous frame, logic only touches live video state
+    if (LCDgetDrawFlag())
+    {
+        if (behind && skipped_in_row < MAX_FRAMESKIP)
+        { // Only the newest frame is going to be seen
+            skipFrame();
+            skipped_in_row++;
+            frames_skipped++;
+            return;
+        }
+        skipped_in_row = 0;
+        // Logic finished a frame, snapshot it and hand it to the render worker
+        acquire_snapshot();
+        snapshotVideo();
+        if (interpolate)
+        { // The presenter renders it, a little further along each refresh
+            previous_snapshot_time = snapshot_time;
+            snapshot_time = g_get_monotonic_time();
+            g_atomic_int_inc(&snapshot_serial);
+            release_snapshot();
+            wake_presenter();
+            return;
+        }
+        request_render(256);
+    }
+}
+
+// Runs on the GTK thread once per display refresh. Shows the newest finished frame, older ones are never drawn
+static gboolean frame_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer data)
+{
+    static int quiet = 0;
+
+    if (!presenter_busy())
+    {
+        if (++quiet < QUIET_REFRESHES)
         {
-            pthread_join(thread_info, NULL);
+            return G_SOURCE_CONTINUE;
+        }
+        quiet = 0;
+        g_atomic_int_set(&ticking, 0);
+        if (!presenter_busy() || !g_atomic_int_compare_and_exchange(&ticking, 0, 1))
+        { // Stop until wake_presenter. Checked again after clearing ticking so a frame published in between isn't missed
+            return G_SOURCE_REMOVE;
         }
-        pthread_create(&thread_info, NULL, thread_draw, NULL);
-        if (GTK_IS_WIDGET(window))
+    }
+    quiet = 0;
+
+    if (interpolate && g_atomic_int_compare_and_exchange(&currently_drawing, 0, 1))
+    { // Render the game as it was at this refresh, between the last two logic frames. If logic has the snapshot, try next refresh
+        gint64 newest = snapshot_time; // Safe to read now the snapshot is ours
+        gint64 interval = newest - previous_snapshot_time;
+        int serial = g_atomic_int_get(&snapshot_serial);
+        int blend = 256;
+
+        if (previous_snapshot_time && interval > 0)
+        {
+            gint64 elapsed = gdk_frame_clock_get_frame_time(clock) - newest; // Same clock as g_get_monotonic_time
+            blend = elapsed >= interval ? 256 : elapsed <= 0 ? 0 : (int)(elapsed * 256 / interval);
+        }
+        if (serial != rendered_serial || blend != rendered_blend)
         {
-            gtk_widget_queue_draw(GTK_WIDGET(window));
+            rendered_serial = serial;
+            rendered_blend = blend;
+            request_render(blend);
+        }
+        else
+        {
+            release_snapshot();
         }
     }
-    first_execution = FALSE;
-    return TRUE;
+    else if (interpolate)
+    {
+        g_atomic_int_inc(&refreshes_busy);
+    }
+    if (g_atomic_int_get(&mailbox) & MAILBOX_FRESH)
+    { // Only repaint when there's a new frame, an unchanged frame never reaches the mailbox
+        gtk_widget_queue_draw(widget);
+    }
+    return G_SOURCE_CONTINUE;
 }
 
-void set_speed(char **spc)
+// Fixed timestep scheduler. Ticks are due at absolute times on the monotonic clock, so a late wake up never pushes the
+// ticks after it back, and the game runs at the same rate no matter how long the frames take to render or present
+static void *
+thread_logic(void *ptr)
 {
-    int sp = atoi(spc[1]);
+    long tick = (long)(1000000000LL * SPEED / ((long long)LOGIC_RATE * speed)); // Nanoseconds per tick at this speed
+    struct timespec deadline;
+    struct timespec now;
+    int catchup = MAX_CATCHUP;
+    int replay = 0; // Ticks at the start of the next run that were slept through, they don't see keys pressed since
+
+    traceThread("logic");
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    while (!g_atomic_int_get(&logic_quit))
+    {
+        int ticks = 0;
+        int idle;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        while (ticks < catchup && (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)))
+        {
+            if (ticks == 0 && catchup == MAX_CATCHUP)
+            { // How late the wake up was. Catch up ticks and the ones due during an idle sleep are late on purpose
+                statsRecord(statTickLate, (now.tv_sec - deadline.tv_sec) * 1000000000ULL + now.tv_nsec - deadline.tv_nsec);
+            }
+            deadline.tv_nsec += tick;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_nsec -= 1000000000L;
+                deadline.tv_sec++;
+            }
+            traceBegin("tick", NULL);
+            logic_tick(now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec), ticks >= replay); // Is the next one due already?
+            traceEnd();
+            ticks++;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        }
+        if (ticks == catchup)
+        { // Too far behind (a breakpoint, the window being dragged) to catch up without the game visibly fast forwarding
+            long long late = (now.tv_sec - deadline.tv_sec) * 1000000000LL + now.tv_nsec - deadline.tv_nsec;
+            if (late > 0)
+            {
+                ticks_dropped += late / tick;
+                deadline = now;
+            }
+        }
+        catchup = MAX_CATCHUP;
+        replay = 0;
+
+        idle = idleTicks();
+        if (idle > 1)
+        { // Nothing changes for a while unless a key is pressed. Sleep through it, then run the ticks that came due all at once
+            long long sleep = (idle - 1) * (long long)tick;
+            long long slept;
+            struct timespec wake = deadline;
+            struct timespec woke;
+
+            if (sleep > IDLE_MAX_MS * 1000000LL)
+            {
+                sleep = IDLE_MAX_MS * 1000000LL;
+            }
+            wake.tv_sec += sleep / 1000000000LL;
+            wake.tv_nsec += sleep % 1000000000LL;
+            if (wake.tv_nsec >= 1000000000L)
+            {
+                wake.tv_nsec -= 1000000000L;
+                wake.tv_sec++;
+            }
+            pthread_mutex_lock(&idle_mutex);
+            while (!input_pending && pthread_cond_timedwait(&idle_wake, &idle_mutex, &wake) != ETIMEDOUT)
+            {
+            }
+            pthread_mutex_unlock(&idle_mutex);
+            clock_gettime(CLOCK_MONOTONIC, &woke);
+            idle_seconds += (woke.tv_sec - now.tv_sec) + (woke.tv_nsec - now.tv_nsec) / 1e9;
+            slept = (woke.tv_sec - deadline.tv_sec) * 1000000000LL + woke.tv_nsec - deadline.tv_nsec;
+            if (slept >= 0)
+            { // Ticks came due while asleep. All but the newest run on the buttons from before the sleep, like they would have
+              // awake, so timers and debounce counts keep wall time and a key press lands on the tick it arrived in
+                replay = slept / tick;
+                catchup = replay + 1 + MAX_CATCHUP; // Not behind, so these don't count as dropped
+                continue;
+            }
+            // A key came in before the next tick was due, which takes it as usual
+        }
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+        {
+        }
+    }
+    return NULL;
+}
+
+void set_speed(const char *arg)
+{
+    int sp = atoi(arg);
     if ((sp > 60) && (sp < 500))
     {
         speed = sp;
-        printf("speed set to %d\n", speed);
+        printf("speed set to %d (%.2fx)\n", speed, (double)speed / SPEED);
     }
 }
 
 int main(int argc, char **argv)
 {
-    if (argc > 1)
-    {
-        set_speed(argv);
+    int render_threads = 0;
+    int position = 0;
+
+    for (int arg = 1; arg < argc; arg++)
+    { // Speed, then render threads, options can go anywhere
+        if (strcmp(argv[arg], "--interpolate") == 0)
+        {
+            interpolate = true;
+        }
+        else if (strcmp(argv[arg], "--indexed") == 0)
+        {
+            indexed = true;
+        }
+        else if (strcmp(argv[arg], "--stats") == 0)
+        {
+            print_stats = true;
+        }
+        else if (strcmp(argv[arg], "--trace") == 0)
+        {
+            traceStart();
+        }
+        else if (position++ == 0)
+        {
+            set_speed(argv[arg]);
+        }
+        else
+        {
+            render_threads = atoi(argv[arg]);
+        }
     }
+    start_time = g_get_monotonic_time();
+    traceThread("GTK");
     gameSetup();
+    if (render_threads)
+    { // Optional band render threads, 1 (the default) renders the frame serially on the render worker
+        setRenderThreads(render_threads);
+        printf("render threads set to %d\n", getRenderThreads());
+    }
+    setInterpolation(interpolate);
+    setIndexedFrame(indexed);
     gtk_init(&argc, &argv);
     GtkWidget *main_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(main_window), "Catskillvania");
@@ -83,81 +544,108 @@ int main(int argc, char **argv)
     gtk_window_set_icon(GTK_WINDOW(main_window), icon);
     gtk_window_set_default_size(GTK_WINDOW(main_window), (COLS * 2) + 10, (ROWS * 2) + 10);
     gtk_window_set_resizable(GTK_WINDOW(main_window), FALSE);
-    GtkWidget *drawing_area = gtk_drawing_area_new();
-    g_signal_connect(drawing_area, "configure-event", G_CALLBACK(drawing_area_configure_cb), NULL);
+    drawing_area = gtk_drawing_area_new();
     gtk_container_add(GTK_CONTAINER(main_window), drawing_area);
     gtk_widget_show_all(main_window);
-    pthread_mutex_init(&mutex, NULL);
+    pthread_mutex_init(&worker_mutex, NULL);
+    pthread_condattr_t idle_attr;
+    pthread_condattr_init(&idle_attr);
+    pthread_condattr_setclock(&idle_attr, CLOCK_MONOTONIC); // Idle sleeps end on the same clock the ticks are due on
+    pthread_cond_init(&idle_wake, &idle_attr);
+    pthread_cond_init(&worker_wake, NULL);
+    pthread_cond_init(&worker_done, NULL);
+    for (int i = 0; i < FRAME_BUFFERS; i++)
+    { // Frame size never changes so the surfaces live as long as the game does
+        surfaces[i] = cairo_image_surface_create(CAIRO_FORMAT_RGB24, FRAME_WIDTH, FRAME_HEIGHT);
+    }
     pthread_create(&drawing_thread, NULL, thread_draw, NULL);
     g_signal_connect(drawing_area, "draw", G_CALLBACK(drawing_area_draw_cb), NULL);
+    gtk_widget_add_tick_callback(drawing_area, frame_tick, NULL, NULL); // Paced by the display's frame clock
     g_signal_connect(main_window, "delete-event", G_CALLBACK(close_game), NULL);
     g_signal_connect(main_window, "destroy", G_CALLBACK(gtk_main_quit), NULL);
     g_signal_connect(G_OBJECT(main_window), "key_press_event", G_CALLBACK(keypress_function), NULL);
     g_signal_connect(G_OBJECT(main_window), "key_release_event", G_CALLBACK(keyrelease_function), NULL);
-    g_timeout_add(1000 / speed, (GSourceFunc)timer_exe, drawing_area);
+    pthread_create(&logic_thread, NULL, thread_logic, NULL);
     gtk_main();
-}
-
-static gboolean
-drawing_area_configure_cb(GtkWidget *widget, GdkEventConfigure *event)
-{
-    if (event->type == GDK_CONFIGURE)
+    stop_logic_thread(); // The title screen's exit quits the main loop without going through close_game
+    stop_render_worker();
+    if (print_stats)
     {
-        pthread_mutex_lock(&mutex);
-        if (surface != (cairo_surface_t *)NULL)
-        {
-            cairo_surface_destroy(surface);
-        }
-        surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, COLS, ROWS);
-        pthread_mutex_unlock(&mutex);
+        print_timing();
     }
-
-    return TRUE;
+    traceWrite(TRACE_FILE); // Every thread that records events has stopped by now
 }
 
 static void
 drawing_area_draw_cb(GtkWidget *widget, cairo_t *context, void *ptr)
 {
-    pthread_mutex_lock(&mutex);
-    if (surface != (cairo_surface_t *)NULL)
-    {
-        cairo_scale(context, 2, 2);
-        cairo_set_source_surface(context, surface, 2, 2);
-        cairo_paint(context);
+    statsBegin(statPresent);
+    if (g_atomic_int_get(&mailbox) & MAILBOX_FRESH)
+    { // New frame finished since last paint? Trade our old one for it
+        front_buffer = mailbox_swap(front_buffer) & ~MAILBOX_FRESH;
+        g_atomic_int_inc(&frames_presented);
     }
-    pthread_mutex_unlock(&mutex);
+    cairo_scale(context, 2 * FRAME_SCALE, 2 * FRAME_SCALE);
+    cairo_set_source_surface(context, surfaces[front_buffer], 2.0 / FRAME_SCALE, 2.0 / FRAME_SCALE);
+    cairo_pattern_set_filter(cairo_get_source(context), CAIRO_FILTER_NEAREST); // The only scaling stage, keep the pixels fat
+    cairo_paint(context);
+    statsEnd(statPresent);
 }
 
+// Render worker. Lives for the whole game, sleeps until it's handed a snapshot, renders it into the surface and goes back to sleep
 static void *
 thread_draw(void *ptr)
 {
-    if (surface == (cairo_surface_t *)NULL)
-    {
-        return NULL;
-    }
-    currently_drawing = 1;
-    pthread_mutex_lock(&mutex);
-    cairo_t *context = cairo_create(surface);
-    unsigned char *current_row;
-    current_row = cairo_image_surface_get_data(surface);
-    int stride = cairo_image_surface_get_stride(surface);
-    uint8_t *pf;
-    pf = &playfield[0];
-    for (int y = 0; y < ROWS; y++)
+    traceThread("render");
+    while (1)
     {
-        uint32_t *row = (void *)current_row;
-        for (int x = 0; x < COLS; x++)
+        pthread_mutex_lock(&worker_mutex);
+        while (frame_requested == 0 && worker_quit == 0)
+        {
+            pthread_cond_wait(&worker_wake, &worker_mutex);
+        }
+        if (worker_quit)
+        {
+            if (frame_requested)
+            { // Handed a snapshot it won't draw now, let it go so nothing waits on it
+                frame_requested = 0;
+                g_atomic_int_set(&currently_drawing, 0);
+                pthread_cond_broadcast(&worker_done);
+            }
+            pthread_mutex_unlock(&worker_mutex);
+            break;
+        }
+        frame_requested = 0;
+        int blend = render_blend;
+        pthread_mutex_unlock(&worker_mutex);
+
+        statsBegin(statRenderWorker);
+        cairo_surface_t *surface = surfaces[back_buffer];
+        cairo_surface_flush(surface);
+        statsBegin(statDrawPlayfield);
+        bool changed = drawPlayfieldBlend((uint32_t *)cairo_image_surface_get_data(surface), cairo_image_surface_get_stride(surface), blend);
+        statsEnd(statDrawPlayfield);
+        if (changed)
+        {
+            cairo_surface_mark_dirty(surface);
+        }
+
+        release_snapshot(); // Done with the snapshot, the next one can be taken
+
+        if (!changed)
+        { // Same picture as the last frame, keep the back buffer and let the screen keep showing what it has
+            statsEnd(statRenderWorker);
+            continue;
+        }
+        gint old = mailbox_swap(back_buffer | MAILBOX_FRESH); // Publish the finished frame, take whatever was waiting as the next back buffer
+        back_buffer = old & ~MAILBOX_FRESH;
+        g_atomic_int_inc(&frames_produced);
+        if (old & MAILBOX_FRESH)
         {
-            uint32_t r = *pf++;
-            uint32_t g = *pf++;
-            uint32_t b = *pf++;
-            row[x] = (r << 16) | (g << 8) | b;
+            g_atomic_int_inc(&frames_dropped);
         }
-        current_row += stride;
+        wake_presenter();
+        statsEnd(statRenderWorker);
     }
-    cairo_stroke(context);
-    cairo_destroy(context);
-    pthread_mutex_unlock(&mutex);
-    currently_drawing = 0;
     return NULL;
 }